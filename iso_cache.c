@@ -0,0 +1,297 @@
+/* iso_cache.c
+ *
+ * Copyright (C) 2009 Ricardo Massaro
+ *
+ * Licensed under the terms of the GNU GPL, version 2
+ * http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "iso_cache.h"
+
+/*
+ * Finding the sectors an ISO uses means decrypting its FST, which takes a
+ * while for every estimate and again for the add itself.  The result is
+ * kept in memory and in a file under ~/.cache/wbfs_gtk, keyed by the
+ * identity of the ISO file, so a changed or replaced file is analysed
+ * again.
+ */
+
+#define CACHE_MAGIC "WBFSUSE2"
+#define CACHE_MAX_ENTRIES 32
+
+typedef struct ISO_KEY {
+  unsigned long long dev;
+  unsigned long long ino;
+  unsigned long long size;
+  unsigned long long mtime;
+  unsigned long long mtime_ns;
+} ISO_KEY;
+
+typedef struct CACHE_ENTRY {
+  struct CACHE_ENTRY *next;
+  ISO_KEY key;
+  ISO_INFO info;
+} CACHE_ENTRY;
+
+static CACHE_ENTRY *cache;   /* most recently used first */
+
+static void free_entry(CACHE_ENTRY *e)
+{
+  free(e->info.ext);
+  free(e);
+}
+
+/**
+ * Count the blocks of 2^shift wii sectors holding used sectors, the same
+ * way libwbfs does when adding the disc.
+ */
+static unsigned int count_blocks(ISO_INFO *info, int shift)
+{
+  unsigned int i, first, last, n_units, count = 0;
+  int have_last = 0;
+
+  n_units = WD_N_SECTORS >> shift;
+  last = 0;
+  for (i = 0; i < info->n_ext; i++) {
+    first = info->ext[i].start >> shift;
+    if (have_last && first <= last)
+      first = last + 1;
+    last = (info->ext[i].start + info->ext[i].n - 1) >> shift;
+    if (last >= n_units)
+      last = n_units - 1;
+    if (first <= last)
+      count += last - first + 1;
+    have_last = 1;
+  }
+  return count;
+}
+
+static int get_cache_file(const ISO_KEY *key, char *path, size_t path_size)
+{
+  const char *base = getenv("XDG_CACHE_HOME");
+  char dir[PATH_MAX];
+
+  if (base != NULL && base[0] != '\0')
+    snprintf(dir, sizeof(dir), "%s", base);
+  else if ((base = getenv("HOME")) != NULL)
+    snprintf(dir, sizeof(dir), "%s/.cache", base);
+  else
+    return 1;
+  mkdir(dir, 0700);
+  strncat(dir, "/wbfs_gtk", sizeof(dir) - strlen(dir) - 1);
+  if (mkdir(dir, 0700) != 0 && access(dir, W_OK) != 0)
+    return 1;
+
+  snprintf(path, path_size, "%s/%llx-%llx-%llx-%llx.%09llu.usage", dir,
+	   key->dev, key->ino, key->size, key->mtime, key->mtime_ns);
+  return 0;
+}
+
+/**
+ * Check that the extents read from a cache file are ascending, don't
+ * overlap and stay on the disc, as wd_usage_extents() builds them.
+ */
+static int check_extents(ISO_INFO *info)
+{
+  unsigned int i, end = 0;
+
+  for (i = 0; i < info->n_ext; i++) {
+    if (info->ext[i].start < end || info->ext[i].start >= WD_N_SECTORS
+        || info->ext[i].n == 0 || info->ext[i].n > WD_N_SECTORS - info->ext[i].start)
+      return 1;
+    end = info->ext[i].start + info->ext[i].n;
+  }
+  return 0;
+}
+
+static int load_info(const ISO_KEY *key, ISO_INFO *info)
+{
+  char path[PATH_MAX];
+  char magic[8];
+  FILE *f;
+  int i;
+
+  if (get_cache_file(key, path, sizeof(path)) != 0)
+    return 1;
+  f = fopen(path, "rb");
+  if (f == NULL)
+    return 1;
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, CACHE_MAGIC, 8) != 0
+      || fread(info->code, 1, 6, f) != 6
+      || fread(info->title, 1, sizeof(info->title), f) != sizeof(info->title)
+      || fread(&info->n_ext, sizeof(info->n_ext), 1, f) != 1
+      || info->n_ext > WD_N_SECTORS / 2 + 1)
+    goto err;
+  info->ext = malloc(info->n_ext * sizeof(*info->ext) + 1);
+  if (info->ext == NULL)
+    goto err;
+  if (fread(info->ext, sizeof(*info->ext), info->n_ext, f) != info->n_ext
+      || check_extents(info) != 0) {
+    free(info->ext);
+    info->ext = NULL;
+    goto err;
+  }
+  fclose(f);
+  info->code[6] = '\0';
+  info->title[sizeof(info->title)-1] = '\0';
+  for (i = 0; i < ISO_CACHE_SEC_SIZES; i++)
+    info->blocks[i] = count_blocks(info, i);
+  return 0;
+
+ err:
+  fclose(f);
+  return 1;
+}
+
+static void save_info(const ISO_KEY *key, ISO_INFO *info)
+{
+  char path[PATH_MAX], tmp_path[PATH_MAX + 8];
+  FILE *f;
+  int ok;
+
+  if (get_cache_file(key, path, sizeof(path)) != 0)
+    return;
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  f = fopen(tmp_path, "wb");
+  if (f == NULL)
+    return;
+  ok = (fwrite(CACHE_MAGIC, 1, 8, f) == 8
+	&& fwrite(info->code, 1, 6, f) == 6
+	&& fwrite(info->title, 1, sizeof(info->title), f) == sizeof(info->title)
+	&& fwrite(&info->n_ext, sizeof(info->n_ext), 1, f) == 1
+	&& fwrite(info->ext, sizeof(*info->ext), info->n_ext, f) == info->n_ext);
+  if (fclose(f) != 0 || ! ok || rename(tmp_path, path) != 0)
+    unlink(tmp_path);
+}
+
+/**
+ * Read the header and build the game partition usage of an ISO.
+ */
+static int analyse_iso(const char *filename, ISO_INFO *info)
+{
+  void *f;
+  wiidisc_t *d;
+  u32 *usage;
+  wd_extent_t *ext;
+  u8 header[0x100];
+  int i;
+
+  f = wbfs_open_file_for_read((char *) filename);
+  if (f == NULL)
+    return 1;
+  usage = malloc(WD_USAGE_WORDS * 4);
+  ext = malloc((WD_N_SECTORS / 2 + 1) * sizeof(*ext));
+  d = NULL;
+  if (usage == NULL || ext == NULL
+      || wbfs_read_wii_file(f, 0, sizeof(header), header) != 0
+      || (d = wd_open_disc(wbfs_read_wii_file, f)) == NULL) {
+    free(usage);
+    free(ext);
+    wbfs_close_file(f);
+    return 1;
+  }
+  wd_build_disc_usage(d, ONLY_GAME_PARTITION, usage);
+  wd_close_disc(d);
+  wbfs_close_file(f);
+
+  memcpy(info->code, header, 6);
+  info->code[6] = '\0';
+  memcpy(info->title, header + 0x20, 0x39);
+  info->title[0x39] = '\0';
+  info->n_ext = wd_usage_extents(usage, 0, WD_N_SECTORS, ext);
+  free(usage);
+  info->ext = realloc(ext, info->n_ext * sizeof(*ext) + 1);
+  if (info->ext == NULL)
+    info->ext = ext;
+  for (i = 0; i < ISO_CACHE_SEC_SIZES; i++)
+    info->blocks[i] = count_blocks(info, i);
+  return 0;
+}
+
+/**
+ * Return the analysis of an ISO file, from memory, from the disk cache or
+ * by reading the ISO.  The result is owned by the cache and stays valid
+ * until the next call.
+ */
+ISO_INFO *iso_cache_get(const char *filename)
+{
+  struct stat st;
+  ISO_KEY key;
+  CACHE_ENTRY *e, **pe;
+  int n;
+
+  if (stat(filename, &st) != 0)
+    return NULL;
+  memset(&key, 0, sizeof(key));
+  key.dev = st.st_dev;
+  key.ino = st.st_ino;
+  key.size = st.st_size;
+  key.mtime = st.st_mtim.tv_sec;
+  key.mtime_ns = st.st_mtim.tv_nsec;
+
+  n = 0;
+  for (pe = &cache; (e = *pe) != NULL; pe = &e->next, n++) {
+    if (memcmp(&e->key, &key, sizeof(key)) == 0) {
+      *pe = e->next;
+      e->next = cache;
+      cache = e;
+      return &e->info;
+    }
+    if (n+2 >= CACHE_MAX_ENTRIES) {
+      while (e->next != NULL) {
+        CACHE_ENTRY *old = e->next;
+        e->next = old->next;
+        free_entry(old);
+      }
+    }
+  }
+
+  e = malloc(sizeof(*e));
+  if (e == NULL)
+    return NULL;
+  memset(e, 0, sizeof(*e));
+  e->key = key;
+  if (load_info(&key, &e->info) != 0) {
+    if (analyse_iso(filename, &e->info) != 0) {
+      free(e);
+      return NULL;
+    }
+    save_info(&key, &e->info);
+  }
+  e->next = cache;
+  cache = e;
+  return &e->info;
+}
+
+/**
+ * Return the number of blocks the ISO takes in the partition 'p'.
+ */
+unsigned int iso_info_blocks(ISO_INFO *info, wbfs_t *p)
+{
+  int i = p->wbfs_sec_sz_s - p->wii_sec_sz_s;
+
+  if (i >= ISO_CACHE_SEC_SIZES)
+    return count_blocks(info, i);
+  return info->blocks[i];
+}
+
+/**
+ * Fill the usage bitset passed to wbfs_add_disc_usage().
+ */
+void iso_info_usage(ISO_INFO *info, u32 *usage)
+{
+  unsigned int i, s;
+
+  memset(usage, 0, WD_USAGE_WORDS * 4);
+  for (i = 0; i < info->n_ext; i++)
+    for (s = info->ext[i].start; s < info->ext[i].start + info->ext[i].n; s++)
+      usage[s >> 5] |= 1U << (s & 31);
+}
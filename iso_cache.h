@@ -0,0 +1,29 @@
+/* iso_cache.h
+ *
+ * Copyright (C) 2009 Ricardo Massaro
+ *
+ * Licensed under the terms of the GNU GPL, version 2
+ * http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+#ifndef ISO_CACHE_H_FILE
+#define ISO_CACHE_H_FILE
+
+#include "libwbfs.h"
+
+/* Block counts are kept for WBFS sectors of 2^15 up to 2^31 bytes. */
+#define ISO_CACHE_SEC_SIZES 17
+
+typedef struct ISO_INFO {
+  char code[7];
+  char title[0x40];
+  unsigned int blocks[ISO_CACHE_SEC_SIZES];  /* used blocks, by wbfs_sec_sz_s - 15 */
+  unsigned int n_ext;
+  wd_extent_t *ext;                          /* used wii sectors of the game partition */
+} ISO_INFO;
+
+ISO_INFO *iso_cache_get(const char *filename);
+unsigned int iso_info_blocks(ISO_INFO *info, wbfs_t *p);
+void iso_info_usage(ISO_INFO *info, u32 *usage);
+
+#endif /* ISO_CACHE_H_FILE */
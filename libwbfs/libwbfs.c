@@ -6,12 +6,50 @@
 #include "libwbfs.h"
 #include <errno.h>
 
+#ifndef WIN32
+#include <pthread.h>
+#define WBFS_THREADS
+#else
+#include <ctype.h>
+#endif
+
+// the metadata in memory is shared by every thread using the partition:
+// reading it takes p->lock shared, changing it takes it exclusive.
+// Disc handles have their own copy of the disc info and their own scratch
+// buffer, so wbfs_disc_read() doesn't lock at all.
+#ifdef WBFS_THREADS
+#define META_RDLOCK(p) pthread_rwlock_rdlock(&(p)->lock)
+#define META_WRLOCK(p) pthread_rwlock_wrlock(&(p)->lock)
+#define META_UNLOCK(p) pthread_rwlock_unlock(&(p)->lock)
+#else
+#define META_RDLOCK(p)
+#define META_WRLOCK(p)
+#define META_UNLOCK(p)
+#endif
+
 #ifndef WIN32
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
+#define popcount32(x)   __builtin_popcount(x)
+#define ctz32(x)        __builtin_ctz(x)
 #else
 #define likely(x)		(x)
 #define unlikely(x)		(x)
+static int popcount32(u32 v)
+{
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+static int ctz32(u32 v)
+{
+	int n = 0;
+	while (!(v & 1)) {
+		v >>= 1;
+		n++;
+	}
+	return n;
+}
 #endif
 
 #define ERROR(x) do {wbfs_error(x);goto error;}while(0)
@@ -38,7 +76,285 @@ static u8 size_to_shift(u32 size)
 
 #define read_le32_unaligned(x) ((x)[0]|((x)[1]<<8)|((x)[2]<<16)|((x)[3]<<24))
 
-void wbfs_sync(wbfs_t*p);
+// metadata write-back
+//
+// Changing the metadata in memory doesn't write anything: the hd sectors
+// that changed are marked in p->meta_dirty, one bit per sector from the
+// head to the end of the free table, and meta_write() writes them with
+// one I/O per run of consecutive dirty sectors. p->flush_policy decides
+// whether that happens after each operation or only in wbfs_sync().
+
+static void meta_mark(wbfs_t *p, u32 lba, u32 nlb)
+{
+	for(; nlb; nlb--, lba++)
+		p->meta_dirty[lba>>5] |= 1U<<(lba&31);
+}
+
+#define META_DIRTY(p,lba) ((p)->meta_dirty[(lba)>>5] & (1U<<((lba)&31)))
+
+// the free table sector holding word i
+#define meta_mark_freeblks(p,i) meta_mark(p,(p)->freeblks_lba+(((i)*4)>>(p)->hd_sec_sz_s),1)
+
+// free block bitmap.
+// p->freeblks is kept in host order (bit j of word i set = block i*32+j+1 free),
+// the big endian disc format is only produced when it is written back.
+// p->freeblks_summary has bit i set when freeblks[i] has at least one free block.
+
+#define FREEBLKS_WORDS(p) ((p)->n_wbfs_sec/32)
+
+static void freeblks_update_summary(wbfs_t *p, u32 i)
+{
+	if (p->freeblks[i])
+		p->freeblks_summary[i>>5] |= 1U<<(i&31);
+	else
+		p->freeblks_summary[i>>5] &= ~(1U<<(i&31));
+}
+
+// recompute the summary level and the free count from freeblks
+static void freeblks_rebuild(wbfs_t *p)
+{
+	u32 i, n = FREEBLKS_WORDS(p);
+	wbfs_memset(p->freeblks_summary, 0, ((n+31)/32)*4);
+	p->n_free_blks = 0;
+	for (i = 0; i < n; i++)
+	{
+		p->n_free_blks += popcount32(p->freeblks[i]);
+		freeblks_update_summary(p, i);
+	}
+	p->freeblks_cursor = 0;
+}
+
+static int freeblks_alloc(wbfs_t *p)
+{
+	p->freeblks = wbfs_ioalloc(ALIGN_LBA(p->n_wbfs_sec/8));
+	p->freeblks_summary = wbfs_malloc(((FREEBLKS_WORDS(p)+31)/32)*4 + 4);
+	if (!p->freeblks || !p->freeblks_summary)
+		return 1;
+	wbfs_memset(p->freeblks, 0, ALIGN_LBA(p->n_wbfs_sec/8));
+	return 0;
+}
+
+// index (0 based) of the first free block at or after start, ~0 if none
+static u32 freeblks_find(wbfs_t *p, u32 start)
+{
+	u32 n = FREEBLKS_WORDS(p);
+	u32 i = start>>5;
+	u32 v;
+	if (i >= n)
+		return ~0;
+	v = p->freeblks[i] & (~0U<<(start&31));
+	if (v)
+		return (i<<5) + ctz32(v);
+	for (i++; i < n; i = (i|31)+1)
+	{
+		v = p->freeblks_summary[i>>5] & (~0U<<(i&31));
+		if (v)
+		{
+			i = (i&~31U) + ctz32(v);
+			return (i<<5) + ctz32(p->freeblks[i]);
+		}
+	}
+	return ~0;
+}
+
+// metadata image
+//
+// Every disc_info block is read once, with the free table, when the
+// partition is opened and kept in p->disc_info_img. Disc ids are hashed
+// to their slot, so finding a disc does no I/O. Whatever writes a
+// disc_info goes through disc_info_write() to keep the image current,
+// and rebuilds the index once disc_table or an id changed.
+
+#define DISC_INFO(p,i) ((wbfs_disc_info_t *)((p)->disc_info_img + (i)*(p)->disc_info_sz))
+
+static u32 disc_id_hash(const u8 *id)
+{
+	u32 h = 2166136261U;
+	int k;
+	for(k=0;k<6;k++)
+#ifdef WIN32
+		h = (h ^ toupper(id[k])) * 16777619U;
+#else
+		h = (h ^ id[k]) * 16777619U;
+#endif
+	return h;
+}
+
+static void disc_index_rebuild(wbfs_t *p)
+{
+	u32 i, h;
+	wbfs_memset(p->disc_index,0,(p->disc_index_mask+1)*sizeof(u16));
+	for(i=0;i<p->max_disc;i++)
+	{
+		if(!p->head->disc_table[i])
+			continue;
+		h = disc_id_hash(DISC_INFO(p,i)->disc_header_copy);
+		while(p->disc_index[h & p->disc_index_mask])
+			h++;
+		p->disc_index[h & p->disc_index_mask] = i+1;
+	}
+}
+
+// slot of the first disc with this id, -1 if there is none
+static int disc_index_find(wbfs_t *p, u8 *discid)
+{
+	u32 h = disc_id_hash(discid), i;
+	for(; (i = p->disc_index[h & p->disc_index_mask]); h++)
+#ifdef WIN32
+		if(_strnicmp(discid,DISC_INFO(p,i-1)->disc_header_copy,6)==0)
+#else
+		if(wbfs_memcmp(discid,DISC_INFO(p,i-1)->disc_header_copy,6)==0)
+#endif
+			return i-1;
+	return -1;
+}
+
+static void disc_info_write(wbfs_t *p, u32 slot, void *info)
+{
+	u32 nlb = p->disc_info_sz>>p->hd_sec_sz_s;
+	if(info != DISC_INFO(p,slot))
+		wbfs_memcpy(DISC_INFO(p,slot),info,p->disc_info_sz);
+	meta_mark(p,1+slot*nlb,nlb);
+}
+
+// the disc_info blocks and the free table, with one read unless they are
+// far apart
+static int load_metadata(wbfs_t *p)
+{
+	u32 i, info_nlb = p->max_disc*(p->disc_info_sz>>p->hd_sec_sz_s);
+	u32 fb_sz = ALIGN_LBA(p->n_wbfs_sec/8), fb_nlb = fb_sz>>p->hd_sec_sz_s;
+	u32 gap = p->freeblks_lba - (1 + info_nlb);
+	u8 *meta;
+
+	if(freeblks_alloc(p))
+		return 1;
+	if(gap <= info_nlb + fb_nlb)
+	{
+		u32 nlb = p->freeblks_lba - 1 + fb_nlb;
+		meta = wbfs_ioalloc(nlb<<p->hd_sec_sz_s);
+		if(!meta)
+			return 1;
+		if(p->read_hdsector(p->callback_data,p->part_lba+1,nlb,meta))
+		{
+			wbfs_iofree(meta);
+			return 1;
+		}
+		wbfs_memcpy(p->disc_info_img,meta,info_nlb<<p->hd_sec_sz_s);
+		wbfs_memcpy(p->freeblks,meta+((p->freeblks_lba-1)<<p->hd_sec_sz_s),fb_sz);
+		wbfs_iofree(meta);
+	}
+	else if(p->read_hdsector(p->callback_data,p->part_lba+1,info_nlb,p->disc_info_img)
+		|| p->read_hdsector(p->callback_data,p->part_lba+p->freeblks_lba,fb_nlb,p->freeblks))
+		return 1;
+	for(i=0;i<FREEBLKS_WORDS(p);i++)
+		p->freeblks[i] = wbfs_ntohl(p->freeblks[i]);
+	freeblks_rebuild(p);
+	return 0;
+}
+
+// sector lba of the metadata, as it goes on the disc
+static void meta_get(wbfs_t *p, u32 lba, u8 *buf)
+{
+	u32 info_nlb = p->max_disc*(p->disc_info_sz>>p->hd_sec_sz_s);
+	if(lba == 0)
+		wbfs_memcpy(buf,p->head,p->hd_sec_sz);
+	else if(lba <= info_nlb)
+		wbfs_memcpy(buf,p->disc_info_img+((lba-1)<<p->hd_sec_sz_s),p->hd_sec_sz);
+	else if(lba >= p->freeblks_lba)
+	{
+		u32 *be = (u32 *)buf, k;
+		u32 i = (lba-p->freeblks_lba)<<(p->hd_sec_sz_s-2);
+		for(k=0;k<p->hd_sec_sz/4;k++,i++)
+			be[k] = i < FREEBLKS_WORDS(p) ? wbfs_htonl(p->freeblks[i]) : 0;
+	}
+	else
+		wbfs_memset(buf,0,p->hd_sec_sz);
+}
+
+// write the dirty sectors in ascending order, a run at a time.
+// sectors that failed stay dirty.
+static int meta_write(wbfs_t *p)
+{
+	u32 lba = 0, n, k;
+	int ret = 0;
+	u8 *buf;
+	if(!p->write_hdsector)
+		return 0;
+	while(lba < p->meta_nlb)
+	{
+		if(!p->meta_dirty[lba>>5])
+		{
+			lba = (lba|31)+1;
+			continue;
+		}
+		if(!META_DIRTY(p,lba))
+		{
+			lba++;
+			continue;
+		}
+		for(n=1; lba+n < p->meta_nlb && META_DIRTY(p,lba+n); n++)
+			;
+		buf = wbfs_ioalloc(n<<p->hd_sec_sz_s);
+		if(!buf)
+		{
+			wbfs_error("allocating memory");
+			return 1;
+		}
+		for(k=0;k<n;k++)
+			meta_get(p,lba+k,buf+(k<<p->hd_sec_sz_s));
+		if(p->write_hdsector(p->callback_data,p->part_lba+lba,n,buf))
+			ret = 1;
+		else
+			for(k=0;k<n;k++)
+				p->meta_dirty[(lba+k)>>5] &= ~(1U<<((lba+k)&31));
+		wbfs_iofree(buf);
+		p->meta_unflushed = 1;
+		lba += n;
+	}
+	return ret;
+}
+
+// the write operations refuse a partition opened without write_hdsector
+static int read_only(wbfs_t *p)
+{
+	if(p->write_hdsector)
+		return 0;
+	wbfs_error("partition is read-only");
+	return 1;
+}
+
+static void meta_sync(wbfs_t *p)
+{
+	// a batch only writes on commit
+	if(p->batch)
+		return;
+	// copy back descriptors
+	meta_write(p);
+	if(p->meta_unflushed && p->flush_hd)
+	{
+		p->flush_hd(p->callback_data);
+		p->meta_unflushed = 0;
+	}
+}
+
+// an operation is done with the metadata
+static void meta_op_done(wbfs_t *p)
+{
+	if(p->batch)
+		return;
+	switch(p->flush_policy)
+	{
+	case WBFS_FLUSH_ON_SYNC:
+		break;
+	case WBFS_FLUSH_EACH_OP_SYNC:
+		meta_sync(p);
+		break;
+	case WBFS_FLUSH_EACH_OP:
+	default:
+		meta_write(p);
+		break;
+	}
+}
 
 wbfs_t*wbfs_open_hd(
 					rw_sector_callback_t read_hdsector,
@@ -102,6 +418,12 @@ wbfs_t*wbfs_open_partition(rw_sector_callback_t read_hdsector,
 	wbfs_t *p = wbfs_malloc(sizeof(wbfs_t));
 	
 	wbfs_head_t *head = wbfs_ioalloc(hd_sector_size?hd_sector_size:512);
+	u32 n;
+
+	wbfs_memset(p,0,sizeof(*p));
+#ifdef WBFS_THREADS
+	pthread_rwlock_init(&p->lock,0);
+#endif
 
 	//constants, but put here for consistancy
 	p->wii_sec_sz = 0x8000;
@@ -110,6 +432,8 @@ wbfs_t*wbfs_open_partition(rw_sector_callback_t read_hdsector,
 	p->n_wii_sec_per_disc = 143432*2;//support for double layers discs..
 	p->head = head;
 	p->part_lba = part_lba;
+	if (reset && !write_hdsector)
+		ERROR("can't format a read-only partition");
 	// init the partition
 	if (reset)
 	{
@@ -153,24 +477,66 @@ wbfs_t*wbfs_open_partition(rw_sector_callback_t read_hdsector,
 	p->callback_data = callback_data;
 
 	p->freeblks_lba = (p->wbfs_sec_sz - p->n_wbfs_sec/8)>>p->hd_sec_sz_s;
+	p->meta_nlb = p->freeblks_lba + (ALIGN_LBA(p->n_wbfs_sec/8)>>p->hd_sec_sz_s);
+	p->meta_dirty = wbfs_malloc(((p->meta_nlb+31)/32)*4);
+	if(!p->meta_dirty)
+		ERROR("allocating memory");
+	wbfs_memset(p->meta_dirty,0,((p->meta_nlb+31)/32)*4);
 	
-	if(!reset)
-		p->freeblks = 0; // will alloc and read only if needed
-	else
+	p->freeblks = 0; // will alloc and read only if needed
+	p->freeblks_summary = 0;
+	if(reset)
 	{
 		// init with all free blocks
-		p->freeblks = wbfs_ioalloc(ALIGN_LBA(p->n_wbfs_sec/8));
-		wbfs_memset(p->freeblks,0xff,p->n_wbfs_sec/8);
+		if(freeblks_alloc(p))
+			ERROR("allocating memory");
+		wbfs_memset(p->freeblks,0xff,FREEBLKS_WORDS(p)*4);
+		freeblks_rebuild(p);
+		meta_mark(p,0,1);
+		meta_mark(p,p->freeblks_lba,p->meta_nlb-p->freeblks_lba);
 	}
 	p->max_disc = (p->freeblks_lba-1)/(p->disc_info_sz>>p->hd_sec_sz_s);
 	if(p->max_disc > p->hd_sec_sz - sizeof(wbfs_head_t))
 		p->max_disc = p->hd_sec_sz - sizeof(wbfs_head_t);
 
-	p->tmp_buffer = wbfs_ioalloc(p->hd_sec_sz);
+	p->disc_info_img = wbfs_ioalloc(p->max_disc*p->disc_info_sz);
+	for(n=1;n<2U*p->max_disc;n<<=1)
+		;
+	p->disc_index = wbfs_malloc(n*sizeof(u16));
+	p->disc_index_mask = n-1;
+	if(!p->disc_info_img || !p->disc_index)
+		ERROR("allocating memory");
+	if(reset)
+		wbfs_memset(p->disc_info_img,0,p->max_disc*p->disc_info_sz);
+	else if(load_metadata(p))
+		ERROR("reading metadata");
+	disc_index_rebuild(p);
+
 	p->n_disc_open = 0;
+	p->alloc_policy = WBFS_ALLOC_BEST_FIT_EXTENT;
+	p->max_io_sz = 8<<20;
+	p->pipeline_mem = 32<<20;
+	p->io_depth = 1;
+	p->disc_cache_lines = 64;
+	p->disc_readahead = 16;
+	p->extract_threads = 4;
+	p->flush_policy = WBFS_FLUSH_EACH_OP;
 	wbfs_sync(p);
 	return p;
 error:
+	if(p->meta_dirty)
+		wbfs_free(p->meta_dirty);
+	if(p->disc_info_img)
+		wbfs_iofree(p->disc_info_img);
+	if(p->disc_index)
+		wbfs_free(p->disc_index);
+	if(p->freeblks)
+		wbfs_iofree(p->freeblks);
+	if(p->freeblks_summary)
+		wbfs_free(p->freeblks_summary);
+#ifdef WBFS_THREADS
+	pthread_rwlock_destroy(&p->lock);
+#endif
 	wbfs_free(p);
 	wbfs_iofree(head);
 	return 0;
@@ -179,27 +545,30 @@ error:
 
 void wbfs_sync(wbfs_t*p)
 {
-	// copy back descriptors
-	if(p->write_hdsector){
-		p->write_hdsector(p->callback_data,p->part_lba+0,1, p->head);
-		
-		if(p->freeblks) {
-					p->write_hdsector(p->callback_data,p->part_lba+p->freeblks_lba,ALIGN_LBA(p->n_wbfs_sec/8)>>p->hd_sec_sz_s, p->freeblks);
-		}
-
-	}
+	META_WRLOCK(p);
+	meta_sync(p);
+	META_UNLOCK(p);
 }
 void wbfs_close(wbfs_t*p)
 {
+	if(p->batch)
+		wbfs_abort_batch(p);
 	wbfs_sync(p);
 
 	if(p->n_disc_open)
 		ERROR("trying to close wbfs while discs still open");
 
 	wbfs_iofree(p->head);
-	wbfs_iofree(p->tmp_buffer);
 	if(p->freeblks)
 		wbfs_iofree(p->freeblks);
+	if(p->freeblks_summary)
+		wbfs_free(p->freeblks_summary);
+	wbfs_iofree(p->disc_info_img);
+	wbfs_free(p->disc_index);
+	wbfs_free(p->meta_dirty);
+#ifdef WBFS_THREADS
+	pthread_rwlock_destroy(&p->lock);
+#endif
 	
 	p->close_hd(p->callback_data);
 
@@ -209,47 +578,209 @@ error:
 	return;
 }
 
-wbfs_disc_t *wbfs_open_disc(wbfs_t* p, u8 *discid)
+// disc read cache
+//
+// Each disc handle caches the disc in 32KB lines (a wii sector), least
+// recently used first out, so the small unaligned requests of a loader or
+// a filesystem walk don't read the same hd sectors again and again. When
+// a request starts where the previous one ended the stream is taken as
+// sequential and a miss reads up to disc_readahead lines at once, without
+// going past the wbfs sector. Requests covering whole lines that aren't
+// cached go straight to the caller's buffer.
+
+#define DISC_LINE_S 15
+#define DISC_LINE_SZ (1<<DISC_LINE_S)
+
+struct wbfs_disc_cache_s
+{
+	u32 n;		// lines
+	u32 ra;		// lines read ahead
+	u8 *data;	// n lines
+	u8 *staging;	// ra lines, for reading ahead with one request
+	u32 *tag;	// disc line held by each slot, ~0 for none
+	u32 *prev;	// LRU list of the slots, most recent first
+	u32 *next;
+	u32 mru;
+	u32 lru;
+	u64 next_pos;	// where a sequential stream goes on
+};
+
+static wbfs_disc_cache_t *disc_cache_new(wbfs_t *p)
+{
+	wbfs_disc_cache_t *c;
+	u32 i, ra = p->disc_readahead;
+	if(!p->disc_cache_lines)
+		return 0;
+	if(ra > p->disc_cache_lines)
+		ra = p->disc_cache_lines;
+	if(ra > (p->wbfs_sec_sz>>DISC_LINE_S))
+		ra = p->wbfs_sec_sz>>DISC_LINE_S;
+	if(ra < 1)
+		ra = 1;
+	c = wbfs_malloc(sizeof(*c));
+	if(!c)
+		return 0;
+	c->n = p->disc_cache_lines;
+	c->ra = ra;
+	c->data = wbfs_ioalloc((size_t)c->n<<DISC_LINE_S);
+	c->staging = ra > 1 ? wbfs_ioalloc(ra<<DISC_LINE_S) : 0;
+	c->tag = wbfs_malloc(c->n*4);
+	c->prev = wbfs_malloc(c->n*4);
+	c->next = wbfs_malloc(c->n*4);
+	if(!c->data || (ra > 1 && !c->staging) || !c->tag || !c->prev || !c->next)
+	{
+		if(c->data)
+			wbfs_iofree(c->data);
+		if(c->staging)
+			wbfs_iofree(c->staging);
+		wbfs_free(c->tag);
+		wbfs_free(c->prev);
+		wbfs_free(c->next);
+		wbfs_free(c);
+		return 0;
+	}
+	for(i=0;i<c->n;i++)
+	{
+		c->tag[i] = ~0;
+		c->prev[i] = i-1;
+		c->next[i] = i+1;
+	}
+	c->mru = 0;
+	c->lru = c->n-1;
+	c->next_pos = ~0ULL;
+	return c;
+}
+
+static void disc_cache_free(wbfs_disc_cache_t *c)
+{
+	wbfs_iofree(c->data);
+	if(c->staging)
+		wbfs_iofree(c->staging);
+	wbfs_free(c->tag);
+	wbfs_free(c->prev);
+	wbfs_free(c->next);
+	wbfs_free(c);
+}
+
+// slot holding line, ~0 if it isn't cached
+static u32 disc_cache_find(wbfs_disc_cache_t *c, u32 line)
 {
 	u32 i;
-	int disc_info_sz_lba = p->disc_info_sz>>p->hd_sec_sz_s;
-	wbfs_disc_t *d = 0;
-	for(i=0;i<p->max_disc;i++)
+	if(c->tag[c->mru] == line)
+		return c->mru;
+	for(i=0;i<c->n;i++)
+		if(c->tag[i] == line)
+			return i;
+	return ~0;
+}
+
+// make slot the most recently used
+static void disc_cache_touch(wbfs_disc_cache_t *c, u32 i)
+{
+	if(i == c->mru)
+		return;
+	if(i == c->lru)
+		c->lru = c->prev[i];
+	else
+		c->prev[c->next[i]] = c->prev[i];
+	c->next[c->prev[i]] = c->next[i];
+	c->prev[i] = ~0;
+	c->next[i] = c->mru;
+	c->prev[c->mru] = i;
+	c->mru = i;
+}
+
+// hd lba of byte pos of the disc, 0 if that wbfs sector isn't on the partition
+static u32 disc_lba(wbfs_disc_t *d, u64 pos)
+{
+	wbfs_t *p = d->p;
+	u32 wlba = pos>>p->wbfs_sec_sz_s;
+	if(wlba >= p->n_wbfs_sec_per_disc || !d->wlba[wlba])
+		return 0;
+	return p->part_lba + (d->wlba[wlba]<<(p->wbfs_sec_sz_s-p->hd_sec_sz_s))
+		+ ((pos&(p->wbfs_sec_sz-1))>>p->hd_sec_sz_s);
+}
+
+// read line into the cache, and the following ones too for a sequential
+// stream. returns the slot of line, ~0 on error
+static u32 disc_cache_fill(wbfs_disc_t *d, u32 line, int seq)
+{
+	wbfs_t *p = d->p;
+	wbfs_disc_cache_t *c = d->cache;
+	u32 lba = disc_lba(d, (u64)line<<DISC_LINE_S);
+	u32 n = 1, k, slot;
+	u32 sec_lines = p->wbfs_sec_sz>>DISC_LINE_S;
+	if(!lba)
+		return ~0;
+	if(seq)
+		while(n < c->ra && (line+n) % sec_lines
+		      && disc_cache_find(c, line+n) == ~0U)
+			n++;
+	if(n == 1)
 	{
-		if (p->head->disc_table[i]){
-			p->read_hdsector(p->callback_data,
-					 p->part_lba+1+i*disc_info_sz_lba,1,p->tmp_buffer);
-#ifdef WIN32
-			if(_strnicmp(discid,p->tmp_buffer,6)==0){
-#else
-			if(wbfs_memcmp(discid,p->tmp_buffer,6)==0){
-#endif
-				d = wbfs_malloc(sizeof(*d));
-				if(!d)
-					ERROR("allocating memory");
-				d->p = p;
-				d->i = i;
-				d->header = wbfs_ioalloc(p->disc_info_sz);
-				if(!d->header)
-					ERROR("allocating memory");
-				p->read_hdsector(p->callback_data,
-						  p->part_lba+1+i*disc_info_sz_lba,
-						  disc_info_sz_lba,d->header);
-				p->n_disc_open ++;
-//				  for(i=0;i<p->n_wbfs_sec_per_disc;i++)
-//					  printf("%d,",wbfs_ntohs(d->header->wlba_table[i]));
-				return d;
-			}
-		}
+		slot = c->lru;
+		c->tag[slot] = ~0;
+		if(p->read_hdsector(p->callback_data, lba, DISC_LINE_SZ>>p->hd_sec_sz_s,
+				    c->data + ((size_t)slot<<DISC_LINE_S)))
+			return ~0;
+		c->tag[slot] = line;
+		disc_cache_touch(c, slot);
+		return slot;
+	}
+	if(p->read_hdsector(p->callback_data, lba, n<<(DISC_LINE_S-p->hd_sec_sz_s), c->staging))
+		return ~0;
+	// the last read ahead go in first, so line ends up most recent
+	for(k=n; k--; )
+	{
+		slot = c->lru;
+		wbfs_memcpy(c->data + ((size_t)slot<<DISC_LINE_S), c->staging + (k<<DISC_LINE_S), DISC_LINE_SZ);
+		c->tag[slot] = line+k;
+		disc_cache_touch(c, slot);
 	}
+	d->cache_readahead += n-1;
+	return slot;
+}
 
-#ifdef WIN32
-		_set_errno(ENOENT);
-#endif
-	return 0;
+wbfs_disc_t *wbfs_open_disc(wbfs_t* p, u8 *discid)
+{
+	int i;
+	u32 j;
+	wbfs_disc_t *d = wbfs_malloc(sizeof(*d));
+	if(!d)
+		ERROR("allocating memory");
+	wbfs_memset(d,0,sizeof(*d));
+	d->p = p;
+	d->header = wbfs_ioalloc(p->disc_info_sz);
+	d->tmp_buffer = wbfs_ioalloc(p->hd_sec_sz);
+	d->wlba = wbfs_malloc(p->n_wbfs_sec_per_disc*sizeof(u16));
+	if(!d->header || !d->tmp_buffer || !d->wlba)
+		ERROR("allocating memory");
+	META_WRLOCK(p);
+	i = disc_index_find(p,discid);
+	if(i >= 0)
+	{
+		d->i = i;
+		wbfs_memcpy(d->header,DISC_INFO(p,i),p->disc_info_sz);
+		p->n_disc_open ++;
+	}
+	META_UNLOCK(p);
+	if(i >= 0)
+	{
+		for(j=0;j<p->n_wbfs_sec_per_disc;j++)
+			d->wlba[j] = wbfs_ntohs(d->header->wlba_table[j]);
+		// reads just don't get cached if this fails
+		d->cache = disc_cache_new(p);
+		return d;
+	}
 error:
 	if (d) {
-			wbfs_iofree(d);
+			if(d->header)
+				wbfs_iofree(d->header);
+			if(d->tmp_buffer)
+				wbfs_iofree(d->tmp_buffer);
+			if(d->wlba)
+				wbfs_free(d->wlba);
+			wbfs_free(d);
 		}
 #ifdef WIN32
 		_set_errno(ENOENT);
@@ -259,73 +790,102 @@ error:
 }
 void wbfs_close_disc(wbfs_disc_t*d)
 {
+	META_WRLOCK(d->p);
 	d->p->n_disc_open --;
+	META_UNLOCK(d->p);
+	if(d->cache)
+		disc_cache_free(d->cache);
+	wbfs_free(d->wlba);
 	wbfs_iofree(d->header);
+	wbfs_iofree(d->tmp_buffer);
 	wbfs_free(d);
 }
-// offset is pointing 32bit words to address the whole dvd, although len is in bytes
-int wbfs_disc_read(wbfs_disc_t *d, u32 offset, u8 *data, u32 len)
+
+// uncached read, through tmp_buffer for the unaligned head and tail
+static int disc_read_direct(wbfs_disc_t *d, u64 pos, u8 *ptr, u32 len)
 {
- 
 	wbfs_t *p = d->p;
-	u16 wlba = offset>>(p->wbfs_sec_sz_s-2);
-	u32 iwlba_shift = p->wbfs_sec_sz_s - p->hd_sec_sz_s;
-	u32 lba_mask = (p->wbfs_sec_sz-1)>>(p->hd_sec_sz_s);
-	u32 lba = (offset>>(p->hd_sec_sz_s-2))&lba_mask;
-	u32 off = offset&((p->hd_sec_sz>>2)-1);
-	u16 iwlba = wbfs_ntohs(d->header->wlba_table[wlba]);
-	u32 len_copied;
-	int err = 0;
-	u8  *ptr = data;
-	if(unlikely(iwlba==0))
-		return 1;
-	if(unlikely(off)){
-		off*=4;
-		err = p->read_hdsector(p->callback_data,
-				       p->part_lba + (iwlba<<iwlba_shift) + lba, 1, p->tmp_buffer);
-		if(err)
-			return err;
-		len_copied = p->hd_sec_sz - off;
-		if(likely(len < len_copied))
-			len_copied = len;
-		wbfs_memcpy(ptr, p->tmp_buffer + off, len_copied);
-		len -= len_copied;
-		ptr += len_copied;
-		lba++;
-		if(unlikely(lba>lba_mask && len)){
-			lba=0;
-			iwlba =	 wbfs_ntohs(d->header->wlba_table[++wlba]);
-			if(unlikely(iwlba==0))
+	u32 off = pos&(p->hd_sec_sz-1);
+	u32 lba, nlb, n;
+	while(len)
+	{
+		lba = disc_lba(d, pos);
+		if(unlikely(!lba))
+			return 1;
+		if(off || len < p->hd_sec_sz)
+		{
+			n = p->hd_sec_sz - off;
+			if(n > len)
+				n = len;
+			if(p->read_hdsector(p->callback_data, lba, 1, d->tmp_buffer))
+				return 1;
+			wbfs_memcpy(ptr, d->tmp_buffer + off, n);
+			off = 0;
+		}
+		else
+		{
+			// whole hd sectors, up to the end of this wbfs sector
+			nlb = (p->wbfs_sec_sz - (pos&(p->wbfs_sec_sz-1)))>>p->hd_sec_sz_s;
+			if(nlb > len>>p->hd_sec_sz_s)
+				nlb = len>>p->hd_sec_sz_s;
+			if(p->read_hdsector(p->callback_data, lba, nlb, ptr))
 				return 1;
+			n = nlb<<p->hd_sec_sz_s;
 		}
+		pos += n;
+		ptr += n;
+		len -= n;
 	}
-	while(likely(len>=p->hd_sec_sz))
+	return 0;
+}
+
+// offset is pointing 32bit words to address the whole dvd, although len is in bytes
+int wbfs_disc_read(wbfs_disc_t *d, u32 offset, u8 *data, u32 len)
+{
+	wbfs_disc_cache_t *c = d->cache;
+	u64 pos = (u64)offset<<2;
+	int seq;
+	if(!c)
+		return disc_read_direct(d, pos, data, len);
+	seq = pos == c->next_pos;
+	while(len)
 	{
-		u32 nlb = len>>(p->hd_sec_sz_s);
-		
-		if(unlikely(lba + nlb > p->wbfs_sec_sz)) // dont cross wbfs sectors..
-			nlb = p->wbfs_sec_sz-lba;
-		err = p->read_hdsector(p->callback_data,
-				 p->part_lba + (iwlba<<iwlba_shift) + lba, nlb, ptr);
-		if(err)
-			return err;
-		len -= nlb<<p->hd_sec_sz_s;
-		ptr += nlb<<p->hd_sec_sz_s;
-		lba += nlb;
-		if(unlikely(lba>lba_mask && len)){
-			lba = 0;
-			iwlba =wbfs_ntohs(d->header->wlba_table[++wlba]);
-			if(unlikely(iwlba==0))
+		u32 line = pos>>DISC_LINE_S;
+		u32 off = pos&(DISC_LINE_SZ-1);
+		u32 slot = disc_cache_find(c, line);
+		u32 n;
+		if(slot == ~0U && !off && len >= DISC_LINE_SZ)
+		{
+			// whole lines go to data, not through the cache
+			n = len & ~(DISC_LINE_SZ-1);
+			if(disc_read_direct(d, pos, data, n))
 				return 1;
+			d->cache_misses += n>>DISC_LINE_S;
+		}
+		else
+		{
+			if(slot == ~0U)
+			{
+				slot = disc_cache_fill(d, line, seq);
+				if(slot == ~0U)
+					return 1;
+				d->cache_misses++;
+			}
+			else
+			{
+				disc_cache_touch(c, slot);
+				d->cache_hits++;
+			}
+			n = DISC_LINE_SZ - off;
+			if(n > len)
+				n = len;
+			wbfs_memcpy(data, c->data + ((size_t)slot<<DISC_LINE_S) + off, n);
 		}
+		pos += n;
+		data += n;
+		len -= n;
 	}
-	if(unlikely(len)){
-		err = p->read_hdsector(p->callback_data,
-				 p->part_lba + (iwlba<<iwlba_shift) + lba, 1, p->tmp_buffer);
-		if(err)
-			return err;
-		wbfs_memcpy(ptr, p->tmp_buffer, len);
-	}     
+	c->next_pos = pos;
 	return 0;
 }
 
@@ -333,9 +893,11 @@ int wbfs_disc_read(wbfs_disc_t *d, u32 offset, u8 *data, u32 len)
 u32 wbfs_count_discs(wbfs_t*p)
 {
 	u32 i,count=0;
+	META_RDLOCK(p);
 	for(i=0;i<p->max_disc;i++)
 		if (p->head->disc_table[i])
 			count++;
+	META_UNLOCK(p);
 	return count;
 	
 }
@@ -352,166 +914,727 @@ static u32 wbfs_sector_used(wbfs_t *p,wbfs_disc_info_t *di)
 
 u32 wbfs_get_disc_info(wbfs_t*p, u32 index,u8 *header,int header_size,u32 *size)//size in 32 bit
 {
-	u32 i,count=0;
-	int disc_info_sz_lba = p->disc_info_sz>>p->hd_sec_sz_s;
+	u32 i,count=0,ret=1;
+	// dropping a bad entry changes disc_table
+	META_WRLOCK(p);
 	for(i=0;i<p->max_disc;i++)
 		if (p->head->disc_table[i]){
 			if(count++==index)
 			{
-								u32 magic;
+				wbfs_disc_info_t *info = DISC_INFO(p,i);
+				u32 magic;
 
-				p->read_hdsector(p->callback_data,
-						 p->part_lba+1+i*disc_info_sz_lba,1,p->tmp_buffer);
 				if(header_size > (int)p->hd_sec_sz)
 					header_size = p->hd_sec_sz;
-				magic = wbfs_ntohl(*(u32*)(p->tmp_buffer+24));
+				magic = wbfs_ntohl(*(u32*)(info->disc_header_copy+24));
 				if(magic!=0x5D1C9EA3){
 					p->head->disc_table[i]=0;
-					return 1;
+					meta_mark(p,0,1);
+					disc_index_rebuild(p);
+					break;
 				}
-				memcpy(header,p->tmp_buffer,header_size);
+				memcpy(header,info,header_size);
 				if(size)
-				{
-										u32 sec_used;	   
-					u8 *header = wbfs_ioalloc(p->disc_info_sz);
-					
-					p->read_hdsector(p->callback_data,
-							 p->part_lba+1+i*disc_info_sz_lba,disc_info_sz_lba,header);
-					sec_used = wbfs_sector_used(p,(wbfs_disc_info_t *)header);
-					wbfs_iofree(header);
-					*size = sec_used<<(p->wbfs_sec_sz_s-2);
-				}
-				return 0;
+					*size = wbfs_sector_used(p,info)<<(p->wbfs_sec_sz_s-2);
+				ret = 0;
+				break;
 			}
 		}
-	return 1;
+	META_UNLOCK(p);
+	return ret;
 }
 
-static void load_freeblocks(wbfs_t*p)
+u32 wbfs_list_discs(wbfs_t*p, wbfs_disc_entry_t *list, u32 max)
 {
-	if(p->freeblks)
-		return;
-	// XXX should handle malloc error..
-	p->freeblks = wbfs_ioalloc(ALIGN_LBA(p->n_wbfs_sec/8));
-	p->read_hdsector(p->callback_data,p->part_lba+p->freeblks_lba,ALIGN_LBA(p->n_wbfs_sec/8)>>p->hd_sec_sz_s, p->freeblks);
-	
+	u32 i, j, n = 0, dropped = 0;
+	META_WRLOCK(p);
+	for(i=0;i<p->max_disc && n<max;i++)
+	{
+		wbfs_disc_info_t *info = DISC_INFO(p,i);
+		wbfs_disc_entry_t *e = &list[n];
+		u32 prev = 0;
+		if (!p->head->disc_table[i])
+			continue;
+		// same check as wbfs_get_disc_info()
+		if (wbfs_ntohl(*(u32*)(info->disc_header_copy+24)) != 0x5D1C9EA3)
+		{
+			p->head->disc_table[i] = 0;
+			dropped = 1;
+			continue;
+		}
+		wbfs_memcpy(e->id,info->disc_header_copy,6);
+		e->id[6] = 0;
+		wbfs_memcpy(e->title,info->disc_header_copy+0x20,sizeof(e->title)-1);
+		e->title[sizeof(e->title)-1] = 0;
+		e->slot = i;
+		e->n_blocks = 0;
+		e->n_fragments = 0;
+		for(j=0;j<p->n_wbfs_sec_per_disc;j++)
+		{
+			u32 iwlba = wbfs_ntohs(info->wlba_table[j]);
+			if(!iwlba)
+				continue;
+			if(!e->n_blocks++ || iwlba != prev+1)
+				e->n_fragments++;
+			prev = iwlba;
+		}
+		e->size = e->n_blocks<<(p->wbfs_sec_sz_s-2);
+		n++;
+	}
+	if(dropped)
+	{
+		meta_mark(p,0,1);
+		disc_index_rebuild(p);
+	}
+	META_UNLOCK(p);
+	return n;
 }
+
 u32 wbfs_count_usedblocks(wbfs_t*p)
 {
-	u32 i,j,count=0;
-	
-	load_freeblocks(p);
-	for(i=0;i<p->n_wbfs_sec/(8*4);i++)
-	{
-		u32 v = wbfs_ntohl(p->freeblks[i]);
-		if(v == ~0U)
-		     count+=32;
-		else if(v!=0)
-			for(j=0;j<32;j++)
-				if (v & (1<<j))
-					count++;
-	}
-	return count;
+	u32 n;
+	META_RDLOCK(p);
+	n = p->n_free_blks;
+	META_UNLOCK(p);
+	return n;
 }
 
 
-// write access
+// overlapped copies
+//
+// A copy is a list of jobs, each moving n wbfs sectors from src to dst
+// through a read and a write callback; fix, if any, patches a buffer
+// between the two. Between two files the OS clones or copies the blocks
+// itself when it can. Otherwise, with p->io_depth above one and an async
+// queue from the OS layer, up to io_depth reads and writes are kept in
+// flight at once. Otherwise, with threads, the reads run ahead in a helper
+// thread. Either way they go through as many buffers as fit in
+// p->pipeline_mem, while the calling thread calls the spinner, so progress
+// and cancellation keep happening where they did before. When the source
+// is a mapped file, a job that needs no fixing skips its buffer: the write
+// is made straight from the mapping, and the read ahead only faults the
+// pages in.
 
+typedef struct wbfs_copy_job_s
+{
+	u32 src;
+	u32 dst;
+	u32 n;
+	u32 fix;	// the fix callback has to see this one
+}wbfs_copy_job_t;
 
-static int block_used(u8 *used,u32 i,u32 wblk_sz)
+// where job blocks live for one side of the copy: block x of a job is at
+// base + x*off_scale in the callback's units, n blocks are n*len_scale units
+typedef struct wbfs_copy_io_s
 {
-	u32 k;
-	i*=wblk_sz;
-	for(k=0;k<wblk_sz;k++)
-		if(i+k<143432*2 && used[i+k])
-			return 1;
-	return 0;
-}
+	rw_sector_callback_t io;
+	void *data;
+	u32 base;
+	u32 off_scale;
+	u32 len_scale;
+}wbfs_copy_io_t;
 
-static u32 alloc_block(wbfs_t*p)
+typedef int (*copy_fix_t)(void *ctx, wbfs_copy_job_t *job, u8 *buf);
+
+typedef struct wbfs_copy_s
 {
-	u32 i,j;
-	for(i=0;i<p->n_wbfs_sec/(8*4);i++)
-	{
-		u32 v = wbfs_ntohl(p->freeblks[i]);
-		if(v != 0)
-		{
-			for(j=0;j<32;j++)
-				if (v & (1<<j))
-				{
-					p->freeblks[i] = wbfs_htonl(v & ~(1<<j));
-					return (i*32)+j+1;
-				}
-		}
-	}
-	return ~0;
+	wbfs_copy_job_t *jobs;
+	u32 n_jobs;
+	wbfs_copy_io_t *src;
+	copy_fix_t fix;
+	void *ctx;
+	u8 **slots;
+	u8 **bufs;	// what the job in each slot is written from
+	u32 n_slots;
+	u32 sec_sz_s;
+#ifdef WBFS_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	u32 produced;	// jobs read so far
+	u32 consumed;	// jobs written so far
+	int read_error;
+	int abort;
+#endif
+}wbfs_copy_t;
+
+static int copy_io(wbfs_copy_io_t *io, u32 blk, u32 n, u8 *buf)
+{
+	return io->io(io->data, io->base + blk * io->off_scale, n * io->len_scale, buf);
 }
 
-static void free_block(wbfs_t *p,int bl)
+static int copy_read(wbfs_copy_t *c, wbfs_copy_job_t *job, u8 *buf)
 {
-	int i = (bl-1)/(32);
-	int j = (bl-1)&31;
-	u32 v = wbfs_ntohl(p->freeblks[i]);
-	p->freeblks[i] = wbfs_htonl(v | 1<<j);
+	if(copy_io(c->src, job->src, job->n, buf))
+		return 1;
+	return c->fix && job->fix ? c->fix(c->ctx, job, buf) : 0;
 }
 
-u32 wbfs_count_added_disc_blocks
-	(
-		wbfs_t *p,
-		read_wiidisc_callback_t read_src_wii_disc,
-		void *callback_data,
-		progress_callback_t spinner,
-		partition_selector_t sel,
-		int copy_1_1
-	)
+static u8 *copy_map(wbfs_copy_io_t *io, wbfs_copy_job_t *job)
 {
-	int i, ok;
-	u32 wii_sec_per_wbfs_sect = 1 << (p->wbfs_sec_sz_s-p->wii_sec_sz_s);
-	u8 *used = 0;
-	wiidisc_t *d = 0;
-	u32 used_blocks = 0;
+	if(job->fix)
+		return 0;
+	return wbfs_map_sector(io->io, io->data, io->base + job->src * io->off_scale, job->n * io->len_scale);
+}
 
-	ok = 0;
-	used = wbfs_malloc(p->n_wii_sec_per_disc);
-	
+// touch every page of a mapping, so the write finds them in memory
+static void copy_prefault(const u8 *ptr, u32 len)
+{
+	const volatile u8 *v = ptr;
+	u32 i;
+	for(i=0;i<len;i+=4096)
+		(void)v[i];
+	(void)v[len-1];
+}
+
+// get job j ready to be written from slot s: read into the slot, or
+// fault in the mapping of the source
+static int copy_fetch(wbfs_copy_t *c, u32 j, u32 s)
+{
+	u8 *ptr = copy_map(c->src, &c->jobs[j]);
+	if(!ptr)
+	{
+		c->bufs[s] = c->slots[s];
+		return copy_read(c, &c->jobs[j], c->slots[s]);
+	}
+	copy_prefault(ptr, c->jobs[j].n << c->sec_sz_s);
+	c->bufs[s] = ptr;
+	return 0;
+}
+
+static int copy_clone(wbfs_copy_io_t *src, wbfs_copy_io_t *dst, wbfs_copy_job_t *job)
+{
+	if(job->fix)
+		return 1;
+	return wbfs_clone_sectors(src->io, src->data, src->base + job->src * src->off_scale, job->n * src->len_scale,
+				  dst->io, dst->data, dst->base + job->dst * dst->off_scale, job->n * dst->len_scale);
+}
+
+// copies the OS can do without our buffers: cloned or in-kernel copies
+// between two files. Returns -1 if that doesn't work for these handles,
+// else like wbfs_copy
+static int wbfs_copy_clone(wbfs_copy_t *c, wbfs_copy_io_t *dst, u32 buf_sz,
+			   progress_callback_t spinner, u32 cur, u32 tot)
+{
+	u8 *buf = 0, *ptr;
+	u32 j, first;
+	int ret = 0;
+
+	for(first=0;first<c->n_jobs && c->jobs[first].fix;first++)
+		;
+	if(first == c->n_jobs || copy_clone(c->src, dst, &c->jobs[first]))
+		return -1;
+	for(j=0;j<c->n_jobs;j++)
+	{
+		if(j == first || !copy_clone(c->src, dst, &c->jobs[j]))
+			goto next;
+		ptr = copy_map(c->src, &c->jobs[j]);
+		if(!ptr)
+		{
+			// past the end of the mapping, or patched on the way
+			if(!buf)
+				buf = wbfs_ioalloc(buf_sz);
+			if(!buf || copy_read(c, &c->jobs[j], buf))
+			{
+				ret = 1;
+				break;
+			}
+			ptr = buf;
+		}
+		if(copy_io(dst, c->jobs[j].dst, c->jobs[j].n, ptr))
+		{
+			ret = 2;
+			break;
+		}
+	next:
+		cur += c->jobs[j].n;
+		if(spinner)
+			spinner(cur,tot);
+	}
+	if(buf)
+		wbfs_iofree(buf);
+	return ret;
+}
+
+#ifdef WBFS_THREADS
+static void *copy_reader(void *_c)
+{
+	wbfs_copy_t *c = _c;
+	u32 j;
+	int err;
+	for(j=0;j<c->n_jobs;j++)
+	{
+		pthread_mutex_lock(&c->lock);
+		while(c->produced - c->consumed >= c->n_slots && !c->abort)
+			pthread_cond_wait(&c->drained,&c->lock);
+		if(c->abort)
+		{
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+		pthread_mutex_unlock(&c->lock);
+
+		err = copy_fetch(c,j,j%c->n_slots);
+
+		pthread_mutex_lock(&c->lock);
+		if(err)
+			c->read_error = c->abort = 1;
+		else
+			c->produced++;
+		pthread_cond_signal(&c->filled);
+		pthread_mutex_unlock(&c->lock);
+		if(err)
+			break;
+	}
+	return 0;
+}
+#endif
+
+// tags of the async requests: the slot, and whether it is being written
+#define COPY_TAG(slot,wr)	((void *)(size_t)((slot)*2+(wr)+1))
+#define COPY_TAG_SLOT(tag)	(((size_t)(tag)-1)/2)
+#define COPY_TAG_WR(tag)	(((size_t)(tag)-1)&1)
+
+static int wbfs_copy_async(wbfs_t *p, wbfs_copy_t *c, wbfs_copy_io_t *dst,
+			   progress_callback_t spinner, u32 cur, u32 tot)
+{
+	wbfs_aio_t *q;
+	u32 *slot_job, *free_slots, n_free, next = 0, done = 0, inflight = 0, s, j;
+	void *tag;
+	int err, ret = 0;
+
+	q = wbfs_aio_open(p->io_depth);
+	if(!q)
+		return -1;
+	slot_job = wbfs_malloc(2 * c->n_slots * sizeof(u32));
+	if(!slot_job)
+	{
+		wbfs_aio_close(q);
+		return -1;
+	}
+	free_slots = slot_job + c->n_slots;
+	for(n_free=0;n_free<c->n_slots;n_free++)
+		free_slots[n_free] = c->n_slots - 1 - n_free;
+
+	while(done < c->n_jobs)
+	{
+		while(!ret && next < c->n_jobs && n_free && inflight < p->io_depth)
+		{
+			wbfs_copy_job_t *job = &c->jobs[next];
+			s = free_slots[--n_free];
+			slot_job[s] = next++;
+			c->bufs[s] = copy_map(c->src, job);
+			if(c->bufs[s])
+				err = wbfs_aio_submit(q, dst->io, dst->data, dst->base + job->dst * dst->off_scale,
+						      job->n * dst->len_scale, c->bufs[s], COPY_TAG(s,1)) ? 2 : 0;
+			else
+				err = wbfs_aio_submit(q, c->src->io, c->src->data, c->src->base + job->src * c->src->off_scale,
+						      job->n * c->src->len_scale, c->slots[s], COPY_TAG(s,0));
+			if(err)
+			{
+				ret = err;
+				break;
+			}
+			inflight++;
+		}
+		if(!inflight)
+			break;
+
+		err = wbfs_aio_wait(q, &tag);
+		inflight--;
+		s = COPY_TAG_SLOT(tag);
+		j = slot_job[s];
+		if(ret)
+			continue;	// draining after an error
+		if(COPY_TAG_WR(tag))
+		{
+			if(err)
+			{
+				ret = 2;
+				continue;
+			}
+			free_slots[n_free++] = s;
+			done++;
+			cur += c->jobs[j].n;
+			if(spinner)
+				spinner(cur,tot);
+			continue;
+		}
+		if(err || (c->fix && c->jobs[j].fix && c->fix(c->ctx, &c->jobs[j], c->slots[s])))
+		{
+			ret = 1;
+			continue;
+		}
+		if(wbfs_aio_submit(q, dst->io, dst->data, dst->base + c->jobs[j].dst * dst->off_scale,
+				   c->jobs[j].n * dst->len_scale, c->slots[s], COPY_TAG(s,1)))
+		{
+			ret = 2;
+			continue;
+		}
+		inflight++;
+	}
+
+	wbfs_free(slot_job);
+	wbfs_aio_close(q);
+	return ret;
+}
+
+// returns 0 on success, 1 if a read failed, 2 if a write failed
+static int wbfs_copy(wbfs_t *p, wbfs_copy_job_t *jobs, u32 n_jobs, u32 max_run,
+		     wbfs_copy_io_t *src, wbfs_copy_io_t *dst, copy_fix_t fix, void *ctx,
+		     progress_callback_t spinner, u32 cur, u32 tot)
+{
+	wbfs_copy_t c;
+	u32 i, j, buf_sz = max_run << p->wbfs_sec_sz_s;
+	int ret = -1;
+#ifdef WBFS_THREADS
+	pthread_t reader;
+	int threaded = 0;
+#endif
+
+	wbfs_memset(&c,0,sizeof(c));
+	c.jobs = jobs;
+	c.n_jobs = n_jobs;
+	c.src = src;
+	c.fix = fix;
+	c.ctx = ctx;
+	c.sec_sz_s = p->wbfs_sec_sz_s;
+	ret = wbfs_copy_clone(&c,dst,buf_sz,spinner,cur,tot);
+	if(ret >= 0)
+		return ret;
+	c.n_slots = p->pipeline_mem / buf_sz;
+	if(c.n_slots > n_jobs)
+		c.n_slots = n_jobs;
+	if(c.n_slots < 2)
+		c.n_slots = 1;
+	c.slots = wbfs_malloc(2 * c.n_slots * sizeof(u8 *));
+	if(!c.slots)
+		return 1;
+	c.bufs = c.slots + c.n_slots;
+	for(i=0;i<c.n_slots;i++)
+	{
+		c.slots[i] = wbfs_ioalloc(buf_sz);
+		if(!c.slots[i])
+		{
+			// run with what we got
+			c.n_slots = i;
+			break;
+		}
+	}
+	if(c.n_slots == 0)
+	{
+		wbfs_free(c.slots);
+		return 1;
+	}
+
+	if(p->io_depth > 1)
+		ret = wbfs_copy_async(p,&c,dst,spinner,cur,tot);
+	if(ret >= 0)
+		goto out;
+	ret = 0;
+
+#ifdef WBFS_THREADS
+	if(c.n_slots > 1)
+	{
+		pthread_mutex_init(&c.lock,0);
+		pthread_cond_init(&c.filled,0);
+		pthread_cond_init(&c.drained,0);
+		threaded = pthread_create(&reader,0,copy_reader,&c) == 0;
+	}
+	if(threaded)
+	{
+		for(j=0;j<n_jobs;j++)
+		{
+			pthread_mutex_lock(&c.lock);
+			while(c.produced <= j && !c.read_error)
+				pthread_cond_wait(&c.filled,&c.lock);
+			pthread_mutex_unlock(&c.lock);
+			if(c.produced <= j)
+			{
+				ret = 1;
+				break;
+			}
+			if(copy_io(dst,jobs[j].dst,jobs[j].n,c.bufs[j%c.n_slots]))
+			{
+				ret = 2;
+				break;
+			}
+			pthread_mutex_lock(&c.lock);
+			c.consumed++;
+			pthread_cond_signal(&c.drained);
+			pthread_mutex_unlock(&c.lock);
+
+			cur += jobs[j].n;
+			if(spinner)
+				spinner(cur,tot);
+		}
+		pthread_mutex_lock(&c.lock);
+		c.abort = 1;
+		pthread_cond_signal(&c.drained);
+		pthread_mutex_unlock(&c.lock);
+		pthread_join(reader,0);
+	}
+	if(c.n_slots > 1)
+	{
+		pthread_cond_destroy(&c.drained);
+		pthread_cond_destroy(&c.filled);
+		pthread_mutex_destroy(&c.lock);
+	}
+	if(!threaded)
+#endif
+	for(j=0;j<n_jobs;j++)
+	{
+		if(copy_fetch(&c,j,0))
+		{
+			ret = 1;
+			break;
+		}
+		if(copy_io(dst,jobs[j].dst,jobs[j].n,c.bufs[0]))
+		{
+			ret = 2;
+			break;
+		}
+		cur += jobs[j].n;
+		if(spinner)
+			spinner(cur,tot);
+	}
+
+out:
+	for(i=0;i<c.n_slots;i++)
+		wbfs_iofree(c.slots[i]);
+	wbfs_free(c.slots);
+	return ret;
+}
+
+// write access
+
+
+// the wbfs sectors of the source disc that hold used wii sectors, as runs.
+// the disc is scanned unless usage is given. ext needs room for
+// n_wbfs_sec_per_disc/2+1 runs, *n_blocks gets the total. returns the
+// number of runs, ~0 on error
+static u32 disc_usage(wbfs_t *p, read_wiidisc_callback_t read_src_wii_disc,
+		      void *callback_data, partition_selector_t sel, int copy_1_1,
+		      const u32 *usage, wd_extent_t *ext, u32 *n_blocks)
+{
+	u32 *used;
+	wiidisc_t *d;
+	u32 i, n;
+
+	if (copy_1_1)
+	{
+		ext[0].start = 0;
+		ext[0].n = p->n_wbfs_sec_per_disc;
+		*n_blocks = p->n_wbfs_sec_per_disc;
+		return 1;
+	}
+	if (usage)
+	{
+		n = wd_usage_extents(usage, p->wbfs_sec_sz_s - p->wii_sec_sz_s,
+				     p->n_wbfs_sec_per_disc, ext);
+		goto count;
+	}
+	used = wbfs_malloc(WD_USAGE_WORDS * 4);
 	if (!used)
 	{
-			ERROR("unable to alloc memory");
+		wbfs_error("unable to alloc memory");
+		return ~0;
 	}
-  
-	if (!copy_1_1)
+	d = wd_open_disc(read_src_wii_disc, callback_data);
+	if (!d)
 	{
-		d = wd_open_disc(read_src_wii_disc, callback_data);
-		if(!d)
+		wbfs_free(used);
+		wbfs_error("unable to open wii disc");
+		return ~0;
+	}
+	wd_build_disc_usage(d, sel, used);
+	wd_close_disc(d);
+
+	n = wd_usage_extents(used, p->wbfs_sec_sz_s - p->wii_sec_sz_s,
+			     p->n_wbfs_sec_per_disc, ext);
+	wbfs_free(used);
+count:
+	*n_blocks = 0;
+	for (i = 0; i < n; i++)
+		*n_blocks += ext[i].n;
+	return n;
+}
+
+// batches
+//
+// wbfs_begin_batch() keeps a copy of the metadata as it is on the disc,
+// or will be once the sectors already dirty are written. The batch
+// operations only change the in-memory image, so an abort puts the copy
+// back. Blocks that were in use at the start of the batch and get
+// allocated again were freed by a remove and are being overwritten:
+// they are marked in reused, so an abort doesn't bring back a disc
+// whose data is gone.
+
+struct wbfs_batch_s
+{
+	u8 *head;
+	u8 *disc_info_img;
+	u32 *freeblks;
+	u32 *meta_dirty;
+	u32 *reused;
+	u32 n_hd_sec;
+};
+
+// next-fit: continue after the last allocated block, wrap around once
+static u32 alloc_block(wbfs_t*p)
+{
+	u32 b = freeblks_find(p,p->freeblks_cursor);
+	if(b == ~0U && p->freeblks_cursor)
+		b = freeblks_find(p,0);
+	if(b == ~0U)
+		return ~0;
+	if(p->batch && !(p->batch->freeblks[b>>5] & (1U<<(b&31))))
+		p->batch->reused[b>>5] |= 1U<<(b&31);
+	p->freeblks[b>>5] &= ~(1U<<(b&31));
+	freeblks_update_summary(p,b>>5);
+	meta_mark_freeblks(p,b>>5);
+	p->n_free_blks--;
+	p->freeblks_cursor = b+1;
+	return b+1;
+}
+
+static void free_block(wbfs_t *p,int bl)
+{
+	int i = (bl-1)/(32);
+	int j = (bl-1)&31;
+	if(p->freeblks[i] & (1U<<j))
+		return;
+	p->freeblks[i] |= 1U<<j;
+	p->freeblks_summary[i>>5] |= 1U<<(i&31);
+	meta_mark_freeblks(p,i);
+	p->n_free_blks++;
+}
+
+// number of consecutive free blocks starting at block index b
+static u32 freeblks_run_len(wbfs_t *p, u32 b)
+{
+	u32 n = FREEBLKS_WORDS(p);
+	u32 i = b>>5;
+	u32 v = ~p->freeblks[i] & (~0U<<(b&31));
+	while(!v && ++i < n)
+		v = ~p->freeblks[i];
+	if(i >= n)
+		return (n<<5) - b;
+	return (i<<5) + ctz32(v) - b;
+}
+
+// start of the smallest free run of at least count blocks, or of the
+// largest run if none is big enough. ~0 if the partition is full.
+static u32 freeblks_best_fit(wbfs_t *p, u32 count, u32 *run_len)
+{
+	u32 b, len;
+	u32 best = ~0, best_len = 0;
+	for(b = freeblks_find(p,0); b != ~0U; b = freeblks_find(p,b+len))
+	{
+		len = freeblks_run_len(p,b);
+		if(len >= count ? (best_len < count || len < best_len) : len > best_len)
 		{
-			ERROR("unable to open wii disc");
+			best = b;
+			best_len = len;
+			if(len == count)
+				break;
 		}
-		wd_build_disc_usage(d, sel, used);
-		wd_close_disc(d);
-		d = 0;
 	}
+	*run_len = best_len;
+	return best;
+}
 
-	for (i = 0; i < p->n_wbfs_sec_per_disc; i++)
+// reserve count blocks for a new disc, following p->alloc_policy.
+// blocks[] receives the block numbers in the order they should be used.
+static int alloc_blocks(wbfs_t *p, u32 count, u16 *blocks)
+{
+	u32 n = 0, b, len;
+	if(count > p->n_free_blks)
+		return 1;
+	switch(p->alloc_policy)
 	{
-		if (copy_1_1 || block_used(used, i, wii_sec_per_wbfs_sect))
+	case WBFS_ALLOC_FIRST_FIT:
+		// nothing is freed while adding, so next-fit from 0 is first-fit
+		p->freeblks_cursor = 0;
+		// fall through
+	case WBFS_ALLOC_NEXT_FIT:
+		while(n < count)
+			blocks[n++] = alloc_block(p);
+		break;
+	case WBFS_ALLOC_BEST_FIT_EXTENT:
+	default:
+		// one contiguous extent if possible, else as few fragments as possible
+		while(n < count)
 		{
-			used_blocks++;
-			if (spinner)
-				spinner(0, used_blocks);
+			b = freeblks_best_fit(p,count-n,&len);
+			if(b == ~0U)
+				break;
+			p->freeblks_cursor = b;
+			for(; len && n < count; len--)
+				blocks[n++] = alloc_block(p);
 		}
+		break;
 	}
+	if(n < count)
+	{
+		while(n)
+			free_block(p,blocks[--n]);
+		return 1;
+	}
+	return 0;
+}
 
-	ok = 1;
-error:
-	if(d)
-			wd_close_disc(d);
-	if(used)
-			wbfs_free(used);
-	
-	return (ok) ? used_blocks : ~0;
+u32 wbfs_count_added_disc_blocks
+	(
+		wbfs_t *p,
+		read_wiidisc_callback_t read_src_wii_disc,
+		void *callback_data,
+		progress_callback_t spinner,
+		partition_selector_t sel,
+		int copy_1_1
+	)
+{
+	u32 n_ext, used_blocks;
+	wd_extent_t *ext;
+
+	ext = wbfs_malloc((p->n_wbfs_sec_per_disc / 2 + 1) * sizeof(*ext));
+	if (!ext)
+	{
+		wbfs_error("unable to alloc memory");
+		return ~0;
+	}
+	n_ext = disc_usage(p, read_src_wii_disc, callback_data, sel, copy_1_1, 0, ext, &used_blocks);
+	wbfs_free(ext);
+	if (n_ext == ~0U)
+		return ~0;
+	if (spinner)
+		spinner(0, used_blocks);
+	return used_blocks;
 }
 
-u32 wbfs_add_disc
+typedef struct
+{
+	wbfs_t *p;
+	wiidisc_t *d;
+	partition_selector_t sel;
+}add_copy_t;
+
+// job: src = first logical block in the iso, dst = first block on the partition
+static int add_fix_job(void *_a, wbfs_copy_job_t *job, u8 *buf)
+{
+	add_copy_t *a = _a;
+	wbfs_t *p = a->p;
+	u32 pt_blk = 0x40000 >> p->wbfs_sec_sz_s;
+
+	// fix the partition table.
+	if (pt_blk >= job->src && pt_blk < job->src + job->n)
+	{
+		wd_fix_partition_table(a->d, a->sel, buf + ((pt_blk - job->src) << p->wbfs_sec_sz_s) + (0x40000 & (p->wbfs_sec_sz - 1)));
+	}
+	return 0;
+}
+
+static u32 add_disc
 	(
 		wbfs_t *p,
 		read_wiidisc_callback_t read_src_wii_disc,
@@ -519,57 +1642,54 @@ u32 wbfs_add_disc
 		progress_callback_t spinner,
 		partition_selector_t sel,
 		int copy_1_1,
+		const u32 *usage,
 		char *new_name
 	)
 {
 	int i, discn;
-	u32 tot, cur;
-	u32 wii_sec_per_wbfs_sect = 1 << (p->wbfs_sec_sz_s-p->wii_sec_sz_s);
-	wiidisc_t *d = 0;
-	u8 *used = 0;
+	u32 ret = 1;
+	u32 tot, cur, n, k, e, end, n_ext, max_run, n_jobs;
+	u32 pt_blk = 0x40000 >> p->wbfs_sec_sz_s;
+	wd_extent_t *ext = 0;
 	wbfs_disc_info_t *info = 0;
-	u8* copy_buffer = 0;
+	wbfs_copy_job_t *jobs = 0;
+	add_copy_t a;
+	wbfs_copy_io_t src, dst;
+	u16 *blocks = 0;
 	u8 *b;
-	int disc_info_sz_lba;
-	used = wbfs_malloc(p->n_wii_sec_per_disc);
+	if (read_only(p))
+		return 1;
+	ext = wbfs_malloc((p->n_wbfs_sec_per_disc / 2 + 1) * sizeof(*ext));
 	
-	if (!used)
+	if (!ext)
 	{
 			ERROR("unable to alloc memory");
 	}
 	
-	if (!copy_1_1)
-	{
-		d = wd_open_disc(read_src_wii_disc, callback_data);
-		if(!d)
-		{
-			ERROR("unable to open wii disc");
-		}
-		wd_build_disc_usage(d, sel, used);
-			wd_close_disc(d);
-			d = 0;
-	}
+	n_ext = disc_usage(p, read_src_wii_disc, callback_data, sel, copy_1_1, usage, ext, &tot);
+	if (n_ext == ~0U)
+		goto error;
 	
-	for (i = 0; i < p->max_disc; i++) // find a free slot.
+	// fail early if there is no free slot, one is taken once the disc is copied
+	META_RDLOCK(p);
+	for (i = 0; i < p->max_disc; i++)
 	{
 		if (p->head->disc_table[i] == 0)
 		{
 			break;
 		}
 	}
+	META_UNLOCK(p);
 
 	if (i == p->max_disc)
 	{
 		ERROR("no space left on device (table full)");
 	}
 
-	p->head->disc_table[i] = 1;
-	discn = i;
-	load_freeblocks(p);
-
 	// build disc info
 	info = wbfs_ioalloc(p->disc_info_sz);
 	b = (u8 *)info;
+	wbfs_memset(info, 0, p->disc_info_sz);
 	read_src_wii_disc(callback_data, 0, 0x100, info->disc_header_copy);
 	
 	if (new_name)
@@ -581,123 +1701,205 @@ u32 wbfs_add_disc
 	
 	fprintf(stderr, "adding %c%c%c%c%c%c %s...\n",b[0], b[1], b[2], b[3], b[4], b[5], b + 0x20);
 
-	copy_buffer = wbfs_ioalloc(p->wbfs_sec_sz);
-	if (!copy_buffer)
-	{
-			ERROR("alloc memory");
-	}
+	// runs of blocks contiguous both in the source and on the partition
+	// are copied with a single read and write of up to max_io_sz bytes
+	max_run = p->max_io_sz >> p->wbfs_sec_sz_s;
+	if (max_run == 0)
+		max_run = 1;
 	
-	tot = 0;
 	cur = 0;
 	
+	// reserve all the blocks up front
 	if (spinner)
+		spinner(0, tot);
+
+	blocks = wbfs_malloc(tot * sizeof(*blocks) + 1);
+	jobs = wbfs_malloc(tot * sizeof(*jobs) + 1);
+	if (!blocks || !jobs)
 	{
-		// count total number to write for spinner
-		for (i = 0; i < p->n_wbfs_sec_per_disc; i++)
-		{
-			if (copy_1_1 || block_used(used, i, wii_sec_per_wbfs_sect))
-			{
-				tot++;
-				spinner(0, tot);
-			}
-		}
+		wbfs_free(blocks);
+		blocks = 0;
+		ERROR("alloc memory");
+	}
+	META_WRLOCK(p);
+	k = alloc_blocks(p, tot, blocks);
+	META_UNLOCK(p);
+	if (k)
+	{
+		wbfs_free(blocks);
+		blocks = 0;
+		ERROR("no space left on device (disc full)");
 	}
 	
-	for (i = 0; i < p->n_wbfs_sec_per_disc; i++)
+	// plan the copy: one job per run, and fill the lookup table.
+	// unused blocks stay 0 from the memset above
+	n_jobs = 0;
+	for (e = 0; e < n_ext; e++)
 	{
-		u16 bl = 0;
-		if (copy_1_1 || block_used(used, i, wii_sec_per_wbfs_sect))
+		end = ext[e].start + ext[e].n;
+		for (k = ext[e].start; k < end; k += n)
 		{
-			bl = alloc_block(p);
-			if (bl == 0xffff)
-			{
-				ERROR("no space left on device (disc full)");
-			}
+			u16 bl = blocks[cur];
+			u32 j;
+			n = 1;
+			// the block with the partition table gets a job of its own, so
+			// everything else can be cloned or written from a mapping
+			while (n < max_run && k + n < end
+			       && blocks[cur + n] == bl + n && k != pt_blk && k + n != pt_blk)
+				n++;
 
-			if(read_src_wii_disc(callback_data, i * (p->wbfs_sec_sz >> 2), p->wbfs_sec_sz, copy_buffer))
-                                ERROR("error reading disc");
+			jobs[n_jobs].src = k;
+			jobs[n_jobs].dst = bl;
+			jobs[n_jobs].n = n;
+			jobs[n_jobs].fix = pt_blk >= k && pt_blk < k + n;
+			n_jobs++;
 
-			// fix the partition table.
-			if (i == (0x40000 >> p->wbfs_sec_sz_s))
-			{
-				wd_fix_partition_table(d, sel, copy_buffer + (0x40000 & (p->wbfs_sec_sz - 1)));
-			}
-
-			p->write_hdsector(p->callback_data, p->part_lba + bl * (p->wbfs_sec_sz / p->hd_sec_sz),
-								p->wbfs_sec_sz / p->hd_sec_sz, copy_buffer);
-			
-			if (spinner)
-			{
-				cur++;
-				spinner(cur, tot);
-			}
+			for (j = 0; j < n; j++)
+				info->wlba_table[k + j] = wbfs_htons(bl + j);
+			cur += n;
 		}
+	}
 
-		info->wlba_table[i] = wbfs_htons(bl);
+	a.p = p;
+	a.d = 0;
+	a.sel = sel;
+	src.io = read_src_wii_disc;
+	src.data = callback_data;
+	src.base = 0;
+	src.off_scale = p->wbfs_sec_sz >> 2;
+	src.len_scale = p->wbfs_sec_sz;
+	dst.io = p->write_hdsector;
+	dst.data = p->callback_data;
+	dst.base = p->part_lba;
+	dst.off_scale = dst.len_scale = p->wbfs_sec_sz / p->hd_sec_sz;
+	switch (wbfs_copy(p, jobs, n_jobs, max_run, &src, &dst, add_fix_job, &a, spinner, 0, tot))
+	{
+	case 1:
+		ERROR("error reading disc");
+	case 2:
+		ERROR("error writing disc");
 	}
 
-	// write disc info
-	disc_info_sz_lba = p->disc_info_sz>>p->hd_sec_sz_s;
-	p->write_hdsector(p->callback_data, p->part_lba + 1 + discn * disc_info_sz_lba,disc_info_sz_lba, info);
-	wbfs_sync(p);
+	// take a slot and write disc info
+	META_WRLOCK(p);
+	for (discn = 0; discn < p->max_disc; discn++)
+		if (p->head->disc_table[discn] == 0)
+			break;
+	if (discn < p->max_disc)
+	{
+		p->head->disc_table[discn] = 1;
+		disc_info_write(p, discn, info);
+		meta_mark(p, 0, 1);
+		disc_index_rebuild(p);
+		meta_op_done(p);
+		wbfs_free(blocks);
+		blocks = 0;
+		ret = 0;
+	}
+	META_UNLOCK(p);
+	if (blocks)
+		ERROR("no space left on device (table full)");
 
 error:
-	if(d)
-			wd_close_disc(d);
-	if(used)
-			wbfs_free(used);
+	// nothing references the reserved blocks until the disc info is written
+	if(blocks)
+	{
+		META_WRLOCK(p);
+		while(tot)
+			free_block(p, blocks[--tot]);
+		META_UNLOCK(p);
+		wbfs_free(blocks);
+	}
+	if(ext)
+			wbfs_free(ext);
 	if(info)
 			wbfs_iofree(info);
-	if(copy_buffer)
-			wbfs_iofree(copy_buffer);
-	
-	// init with all free blocks
+	if(jobs)
+			wbfs_free(jobs);
 
-	return 0;
+	return ret;
+}
+
+u32 wbfs_add_disc
+	(
+		wbfs_t *p,
+		read_wiidisc_callback_t read_src_wii_disc,
+		void *callback_data,
+		progress_callback_t spinner,
+		partition_selector_t sel,
+		int copy_1_1,
+		char *new_name
+	)
+{
+	return add_disc(p, read_src_wii_disc, callback_data, spinner, sel, copy_1_1, 0, new_name);
+}
+
+u32 wbfs_add_disc_usage
+	(
+		wbfs_t *p,
+		read_wiidisc_callback_t read_src_wii_disc,
+		void *callback_data,
+		progress_callback_t spinner,
+		partition_selector_t sel,
+		const u32 *usage,
+		char *new_name
+	)
+{
+	return add_disc(p, read_src_wii_disc, callback_data, spinner, sel, 0, usage, new_name);
 }
 
 u32 wbfs_ren_disc(wbfs_t*p, u8* discid, u8* newname)
 {
-	wbfs_disc_t *d = wbfs_open_disc(p, discid);
-	int disc_info_sz_lba = p->disc_info_sz>>p->hd_sec_sz_s;
-	
-	if(!d)
+	wbfs_disc_info_t *info;
+	int i;
+	if(read_only(p))
+		return 1;
+	META_WRLOCK(p);
+	i = disc_index_find(p, discid);
+	if(i < 0)
+	{
+		META_UNLOCK(p);
 		return 1;
+	}
+	info = DISC_INFO(p, i);
 	
-	memset(d->header->disc_header_copy+0x20, 0, 0x40);
-	strncpy((char *)(d->header->disc_header_copy+0x20), (char*)newname, 0x39);
-	d->header->disc_header_copy[0x20+0x39] = '\0'; //force last char to 0
-
-	p->write_hdsector(p->callback_data,
-					  p->part_lba+1+d->i*disc_info_sz_lba,
-					  disc_info_sz_lba,
-					  d->header);
+	memset(info->disc_header_copy+0x20, 0, 0x40);
+	strncpy((char *)(info->disc_header_copy+0x20), (char*)newname, 0x39);
+	info->disc_header_copy[0x20+0x39] = '\0'; //force last char to 0
+
+	disc_info_write(p, i, info);
 	
-	wbfs_close_disc(d);
-	wbfs_sync(p);
+	meta_op_done(p);
+	META_UNLOCK(p);
 	return 0;
 }
 
 u32 wbfs_nid_disc(wbfs_t*p, u8* discid, u8* newid)
 {
-	wbfs_disc_t *d = wbfs_open_disc(p, discid);
-	int disc_info_sz_lba = p->disc_info_sz>>p->hd_sec_sz_s;
-	
-	if(!d)
+	wbfs_disc_info_t *info;
+	int i;
+	if(read_only(p))
 		return 1;
 	
 	if(strlen((const char *)newid) > 0x6) 
 		return 1;
 	
-	strcpy((char *)(d->header->disc_header_copy+0x0), (const char *)newid);
+	META_WRLOCK(p);
+	i = disc_index_find(p, discid);
+	if(i < 0)
+	{
+		META_UNLOCK(p);
+		return 1;
+	}
+	info = DISC_INFO(p, i);
 	
-	p->write_hdsector(p->callback_data,
-					  p->part_lba+1+d->i*disc_info_sz_lba,
-					  disc_info_sz_lba,
-					  d->header);
+	strcpy((char *)(info->disc_header_copy+0x0), (const char *)newid);
 	
-	wbfs_close_disc(d);
-	wbfs_sync(p);
+	disc_info_write(p, i, info);
+	disc_index_rebuild(p);
+	
+	meta_op_done(p);
+	META_UNLOCK(p);
 	return 0;
 }	
 	
@@ -709,50 +1911,31 @@ u32 wbfs_estimate_disc
                 )
 {
 	u8 *b;
-	int i;
 	u32 tot;
-	u32 wii_sec_per_wbfs_sect = 1 << (p->wbfs_sec_sz_s-p->wii_sec_sz_s);
-	wiidisc_t *d = 0;
-	u8 *used = 0;
+	wd_extent_t *ext = 0;
 	wbfs_disc_info_t *info = 0;
 	
 	tot = 0;
 	
-	used = wbfs_malloc(p->n_wii_sec_per_disc);
-	if (!used)
+	ext = wbfs_malloc((p->n_wbfs_sec_per_disc / 2 + 1) * sizeof(*ext));
+	if (!ext)
 	{
 		ERROR("unable to alloc memory");
 	}
 	
-	d = wd_open_disc(read_src_wii_disc, callback_data);
-	if (!d)
+	if (disc_usage(p, read_src_wii_disc, callback_data, sel, 0, 0, ext, &tot) == ~0U)
 	{
-		ERROR("unable to open wii disc");
+		tot = 0;
+		goto error;
 	}
 	
-	wd_build_disc_usage(d,sel,used);
-	wd_close_disc(d);
-	d = 0;
-	
 	info = wbfs_ioalloc(p->disc_info_sz);
 	b = (u8 *)info;
 	read_src_wii_disc(callback_data, 0, 0x100, info->disc_header_copy);
-	
-	
-	for (i = 0; i < p->n_wbfs_sec_per_disc; i++)
-	{
-		if (block_used(used, i, wii_sec_per_wbfs_sect))
-		{
-			tot++;
-		}
-	}
 
 error:
-	if (d)
-		wd_close_disc(d);
-	
-	if (used)
-		wbfs_free(used);
+	if (ext)
+		wbfs_free(ext);
 	
 	if (info)
 		wbfs_iofree(info);
@@ -762,26 +1945,33 @@ error:
 
 u32 wbfs_rm_disc(wbfs_t*p, u8* discid)
 {
-	wbfs_disc_t *d = wbfs_open_disc(p,discid);
+	wbfs_disc_info_t *info;
 	int i;
 	int discn = 0;
-	int disc_info_sz_lba = p->disc_info_sz>>p->hd_sec_sz_s;
-	if(!d)
+	if(read_only(p))
 		return 1;
+	META_WRLOCK(p);
+	discn = disc_index_find(p,discid);
+	if(discn < 0)
+	{
+		META_UNLOCK(p);
+		return 1;
+	}
+	info = DISC_INFO(p, discn);
 	
-	load_freeblocks(p);
-	discn = d->i;
 	for( i=0; i< p->n_wbfs_sec_per_disc; i++)
 	{
-		u32 iwlba = wbfs_ntohs(d->header->wlba_table[i]);
+		u32 iwlba = wbfs_ntohs(info->wlba_table[i]);
 		if (iwlba)
 			free_block(p,iwlba);
 	}
-	memset(d->header,0,p->disc_info_sz);
-	p->write_hdsector(p->callback_data,p->part_lba+1+discn*disc_info_sz_lba,disc_info_sz_lba,d->header);
+	memset(info,0,p->disc_info_sz);
+	disc_info_write(p, discn, info);
 	p->head->disc_table[discn] = 0;
-	wbfs_close_disc(d);
-	wbfs_sync(p);
+	meta_mark(p, 0, 1);
+	disc_index_rebuild(p);
+	meta_op_done(p);
+	META_UNLOCK(p);
 	return 0;
 }
 
@@ -790,85 +1980,514 @@ u32 wbfs_rm_disc(wbfs_t*p, u8* discid)
 u32 wbfs_trim(wbfs_t*p)
 {
 	u32 maxbl;
-	load_freeblocks(p);
-	maxbl = alloc_block(p);
+	if(read_only(p))
+		return 0;
+	META_WRLOCK(p);
+	if(p->batch)
+	{
+		META_UNLOCK(p);
+		wbfs_error("trim in a batch");
+		return 0;
+	}
+	maxbl = freeblks_find(p,0)+1;
 	p->n_hd_sec = maxbl<<(p->wbfs_sec_sz_s-p->hd_sec_sz_s);
 	p->head->n_hd_sec = wbfs_htonl(p->n_hd_sec);
 	// make all block full
 	memset(p->freeblks,0,p->n_wbfs_sec/8);
-	wbfs_sync(p);
-	// os layer will truncate the file.
+	freeblks_rebuild(p);
+	meta_mark(p,0,1);
+	meta_mark(p,p->freeblks_lba,p->meta_nlb-p->freeblks_lba);
+	// written now whatever the policy, the os layer will truncate the file.
+	meta_sync(p);
+	META_UNLOCK(p);
 	return maxbl;
 }
+
+static void batch_free(wbfs_batch_t *b)
+{
+	if(b->head)
+		wbfs_free(b->head);
+	if(b->disc_info_img)
+		wbfs_free(b->disc_info_img);
+	if(b->freeblks)
+		wbfs_free(b->freeblks);
+	if(b->meta_dirty)
+		wbfs_free(b->meta_dirty);
+	if(b->reused)
+		wbfs_free(b->reused);
+	wbfs_free(b);
+}
+
+u32 wbfs_begin_batch(wbfs_t*p)
+{
+	u32 info_sz = p->max_disc*p->disc_info_sz;
+	u32 fb_sz = ALIGN_LBA(p->n_wbfs_sec/8);
+	u32 dirty_sz = ((p->meta_nlb+31)/32)*4;
+	wbfs_batch_t *b;
+	if(read_only(p))
+		return 1;
+	META_WRLOCK(p);
+	if(p->batch)
+		ERROR("batch already open");
+	b = wbfs_malloc(sizeof(*b));
+	if(!b)
+		ERROR("allocating memory");
+	wbfs_memset(b,0,sizeof(*b));
+	b->head = wbfs_malloc(p->hd_sec_sz);
+	b->disc_info_img = wbfs_malloc(info_sz);
+	b->freeblks = wbfs_malloc(fb_sz);
+	b->meta_dirty = wbfs_malloc(dirty_sz);
+	b->reused = wbfs_malloc(fb_sz);
+	if(!b->head || !b->disc_info_img || !b->freeblks || !b->meta_dirty || !b->reused)
+	{
+		batch_free(b);
+		ERROR("allocating memory");
+	}
+	wbfs_memcpy(b->head,p->head,p->hd_sec_sz);
+	wbfs_memcpy(b->disc_info_img,p->disc_info_img,info_sz);
+	wbfs_memcpy(b->freeblks,p->freeblks,fb_sz);
+	wbfs_memcpy(b->meta_dirty,p->meta_dirty,dirty_sz);
+	wbfs_memset(b->reused,0,fb_sz);
+	b->n_hd_sec = p->n_hd_sec;
+	p->batch = b;
+	META_UNLOCK(p);
+	return 0;
+error:
+	META_UNLOCK(p);
+	return 1;
+}
+
+u32 wbfs_commit(wbfs_t*p)
+{
+	u32 ret = 0;
+	META_WRLOCK(p);
+	if(!p->batch)
+	{
+		META_UNLOCK(p);
+		return 0;
+	}
+	if(p->n_disc_open)
+		ERROR("commit while discs still open");
+	batch_free(p->batch);
+	p->batch = 0;
+	// the data of the added discs before the metadata pointing to it
+	if(p->flush_hd)
+		p->flush_hd(p->callback_data);
+	if(meta_write(p))
+		ret = 1;
+	if(p->meta_unflushed && p->flush_hd)
+	{
+		p->flush_hd(p->callback_data);
+		p->meta_unflushed = 0;
+	}
+	META_UNLOCK(p);
+	return ret;
+error:
+	META_UNLOCK(p);
+	return 1;
+}
+
+void wbfs_abort_batch(wbfs_t*p)
+{
+	wbfs_batch_t *b;
+	u32 i, j, nlb = p->disc_info_sz>>p->hd_sec_sz_s;
+	META_WRLOCK(p);
+	b = p->batch;
+	if(!b)
+		goto error;
+	if(p->n_disc_open)
+		ERROR("abort while discs still open");
+	p->batch = 0;
+	wbfs_memcpy(p->head,b->head,p->hd_sec_sz);
+	wbfs_memcpy(p->disc_info_img,b->disc_info_img,p->max_disc*p->disc_info_sz);
+	wbfs_memcpy(p->freeblks,b->freeblks,ALIGN_LBA(p->n_wbfs_sec/8));
+	wbfs_memcpy(p->meta_dirty,b->meta_dirty,((p->meta_nlb+31)/32)*4);
+	p->n_hd_sec = b->n_hd_sec;
+	freeblks_rebuild(p);
+
+	// drop the removed discs that can't come back
+	for(i=0;i<p->max_disc;i++)
+	{
+		wbfs_disc_info_t *info = DISC_INFO(p,i);
+		if(!p->head->disc_table[i])
+			continue;
+		for(j=0;j<p->n_wbfs_sec_per_disc;j++)
+		{
+			u32 iwlba = wbfs_ntohs(info->wlba_table[j]);
+			if(iwlba && (b->reused[(iwlba-1)>>5] & (1U<<((iwlba-1)&31))))
+				break;
+		}
+		if(j == p->n_wbfs_sec_per_disc)
+			continue;
+		for(j=0;j<p->n_wbfs_sec_per_disc;j++)
+		{
+			u32 iwlba = wbfs_ntohs(info->wlba_table[j]);
+			if(iwlba)
+				free_block(p,iwlba);
+		}
+		wbfs_memset(info,0,p->disc_info_sz);
+		meta_mark(p,1+i*nlb,nlb);
+		p->head->disc_table[i] = 0;
+		meta_mark(p,0,1);
+	}
+	disc_index_rebuild(p);
+	batch_free(b);
+	meta_op_done(p);
+error:
+	META_UNLOCK(p);
+}
 	
 // data extraction
+
+static int job_src_cmp(const void *a, const void *b)
+{
+	const wbfs_copy_job_t *ja = a, *jb = b;
+	return (ja->src > jb->src) - (ja->src < jb->src);
+}
+
 u32 wbfs_extract_disc(wbfs_disc_t*d, rw_sector_callback_t write_dst_wii_sector,void *callback_data,progress_callback_t spinner)
 {
 	wbfs_t *p = d->p;
-	u8* copy_buffer = 0;
-	int tot = 0, cur = 0;
-	int i;
-	int filling_info = 0;
-	
-	int src_wbs_nlb=p->wbfs_sec_sz/p->hd_sec_sz;
-	int dst_wbs_nlb=p->wbfs_sec_sz/p->wii_sec_sz;
-	
-	copy_buffer = wbfs_ioalloc(p->wbfs_sec_sz);
-	
-	if (!copy_buffer)
+	wbfs_copy_job_t *jobs = 0;
+	wbfs_copy_io_t src, dst;
+	u32 tot = 0, n_jobs = 0, max_run;
+	int i, ret;
+
+	max_run = p->max_io_sz >> p->wbfs_sec_sz_s;
+	if (max_run == 0)
+		max_run = 1;
+
+	jobs = wbfs_malloc(p->n_wbfs_sec_per_disc * sizeof(*jobs));
+	if (!jobs)
 		ERROR("alloc memory");
 
+	for (i = 0; i < p->n_wbfs_sec_per_disc; i++)
+	{
+		u32 iwlba = d->wlba[i];
+		if (iwlba)
+		{
+			jobs[tot].src = iwlba;
+			jobs[tot].dst = i;
+			jobs[tot].n = 1;
+			jobs[tot].fix = 0;
+			tot++;
+		}
+	}
 	if (spinner)
+		spinner(0, tot);
+
+	// jobs: src = first block on the partition, dst = first logical block in the iso.
+	// read the partition in disc order, each block still lands at its own
+	// offset in the iso. Blocks adjacent on both sides share one job.
+	qsort(jobs, tot, sizeof(*jobs), job_src_cmp);
+	for (i = 0; i < (int) tot; i++)
 	{
-		// count total number to write for spinner
-		for (i = 0; i < p->n_wbfs_sec_per_disc; i++)
+		if (n_jobs)
 		{
-			u32 iwlba = wbfs_ntohs(d->header->wlba_table[i]);
-			if (iwlba)
+			wbfs_copy_job_t *last = &jobs[n_jobs-1];
+			if (last->n < max_run
+			    && jobs[i].src == last->src + last->n && jobs[i].dst == last->dst + last->n)
 			{
-				tot++;
-				spinner(0, tot);
+				last->n++;
+				continue;
 			}
 		}
+		jobs[n_jobs++] = jobs[i];
 	}
 
-	for (i = 0; i < p->n_wbfs_sec_per_disc; i++)
+	src.io = p->read_hdsector;
+	src.data = p->callback_data;
+	src.base = p->part_lba;
+	src.off_scale = src.len_scale = p->wbfs_sec_sz / p->hd_sec_sz;
+	dst.io = write_dst_wii_sector;
+	dst.data = callback_data;
+	dst.base = 0;
+	dst.off_scale = dst.len_scale = p->wbfs_sec_sz / p->wii_sec_sz;
+	ret = wbfs_copy(p, jobs, n_jobs, max_run, &src, &dst, 0, 0, spinner, 0, tot);
+	wbfs_free(jobs);
+	jobs = 0;
+	if (ret == 1)
+		ERROR("reading disc");
+	if (ret == 2)
+		ERROR("writing disc");
+	return 0;
+error:
+	if (jobs)
+		wbfs_free(jobs);
+	return 1;
+}
+
+// file extraction
+//
+// the data of the files is read in chunks of up to EXTRACT_CHUNK blocks,
+// in order and from the calling thread, since a disc handle is used by one
+// thread at a time. p->extract_threads workers decrypt the chunks read
+// ahead, and the calling thread passes them to the callback in order.
+
+#define EXTRACT_CHUNK 16
+#define EXTRACT_PATH_MAX 0x400
+
+enum { EXTRACT_FREE, EXTRACT_READ, EXTRACT_BUSY, EXTRACT_DONE };
+
+typedef struct
+{
+	u32 file;	// fst entry
+	u32 block;	// first block, in 0x7c00 byte blocks of the partition data
+	u32 n;		// 0 for an empty file
+	int state;
+	u8 *raw;
+	u8 *data;
+}extract_slot_t;
+
+typedef struct
+{
+	wd_fst_t *f;
+	u32 n_slots;
+	extract_slot_t *slots;
+#ifdef WBFS_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t work;	// a chunk was read, or stop is set
+	pthread_cond_t done;	// a chunk was decrypted
+	int stop;
+#endif
+}extract_t;
+
+static int extract_read(void *d, u32 offset, u32 count, void *buf)
+{
+	return wbfs_disc_read(d, offset, buf, count);
+}
+
+static void extract_decrypt(wd_fst_t *f, extract_slot_t *s)
+{
+	u8 iv[16];
+	u32 k;
+	for (k = 0; k < s->n; k++)
 	{
-		u32 iwlba = wbfs_ntohs(d->header->wlba_table[i]);
-		if (iwlba)
+		wbfs_memcpy(iv, s->raw + k*0x8000 + 0x3d0, 16);
+		aes_ctx_decrypt(&f->aes, iv, s->raw + k*0x8000 + 0x400, s->data + k*0x7c00, 0x7c00);
+	}
+}
+
+#ifdef WBFS_THREADS
+static void *extract_worker(void *_e)
+{
+	extract_t *e = _e;
+	u32 i;
+	pthread_mutex_lock(&e->lock);
+	for (;;)
+	{
+		for (i = 0; i < e->n_slots && e->slots[i].state != EXTRACT_READ; i++)
+			;
+		if (i == e->n_slots)
 		{
-			cur++;
-			if (spinner)
-				spinner(cur,tot);
-			
-			if(p->read_hdsector(p->callback_data, p->part_lba + iwlba*src_wbs_nlb, src_wbs_nlb, copy_buffer))
-                                ERROR("reading disc");
-			if(write_dst_wii_sector(callback_data, i*dst_wbs_nlb, dst_wbs_nlb, copy_buffer))
-                                ERROR("writing disc");
-		} 
-		else 
-		{
-			switch (filling_info) {
-				case 0:
-					if (cur == tot)
-						filling_info = 1;
-					break;
-					
-				case 1:
-					fprintf(stderr, "Filling empty space in extracted image. Please wait...\n");
-					filling_info = 2;
-					break;
-					
-				case 2:
-				default:
+			if (e->stop)
+				break;
+			pthread_cond_wait(&e->work, &e->lock);
+			continue;
+		}
+		e->slots[i].state = EXTRACT_BUSY;
+		pthread_mutex_unlock(&e->lock);
+		extract_decrypt(e->f, &e->slots[i]);
+		pthread_mutex_lock(&e->lock);
+		e->slots[i].state = EXTRACT_DONE;
+		pthread_cond_broadcast(&e->done);
+	}
+	pthread_mutex_unlock(&e->lock);
+	return 0;
+}
+#endif
+
+u32 wbfs_extract_file(wbfs_disc_t*d, char *path, write_file_callback_t write_dst_file,void *callback_data,progress_callback_t spinner)
+{
+	wbfs_t *p = d->p;
+	wiidisc_t *w = 0;
+	wd_fst_t *f;
+	extract_t e;
+	extract_slot_t *s;
+	char *name = 0;
+	u32 first, last, file, block = 0, end = 0, named = 0;
+	u32 rd = 0, wr = 0, tot = 0, cur = 0, i;
+	u32 n_threads = 0;
+	int k, have = 0, more = 1, ret = 1;
+#ifdef WBFS_THREADS
+	pthread_t *threads = 0;
+#endif
+
+	wbfs_memset(&e, 0, sizeof(e));
+#ifdef WBFS_THREADS
+	pthread_mutex_init(&e.lock, 0);
+	pthread_cond_init(&e.work, 0);
+	pthread_cond_init(&e.done, 0);
+#endif
+	w = wd_open_disc(extract_read, d);
+	if (!w)
+		ERROR("alloc memory");
+	f = wd_open_fst(w, ONLY_GAME_PARTITION);
+	if (!f)
+		ERROR("unable to read the game partition");
+	k = wd_fst_find_file(f, path);
+	if (k < 0)
+		ERROR("file not found");
+	e.f = f;
+	first = k;
+	last = f->e[k].is_dir ? f->e[k].size : first + 1;
+	for (i = first; i < last; i++)
+		if (!f->e[i].is_dir && f->e[i].size)
+			tot += ((((u64)f->e[i].offset<<2) + f->e[i].size - 1) / 0x7c00)
+				- (((u64)f->e[i].offset<<2) / 0x7c00) + 1;
+	if (spinner)
+		spinner(0, tot);
+
+	e.n_slots = p->pipeline_mem / (EXTRACT_CHUNK * (0x8000 + 0x7c00));
+	if (e.n_slots < 2)
+		e.n_slots = 2;
+	e.slots = wbfs_malloc(e.n_slots * sizeof(*e.slots));
+	name = wbfs_malloc(EXTRACT_PATH_MAX);
+	if (!e.slots || !name)
+		ERROR("alloc memory");
+	wbfs_memset(e.slots, 0, e.n_slots * sizeof(*e.slots));
+	for (i = 0; i < e.n_slots; i++)
+	{
+		e.slots[i].raw = wbfs_ioalloc(EXTRACT_CHUNK * 0x8000);
+		e.slots[i].data = wbfs_malloc(EXTRACT_CHUNK * 0x7c00);
+		if (!e.slots[i].raw || !e.slots[i].data)
+			ERROR("alloc memory");
+	}
+
+#ifdef WBFS_THREADS
+	if (p->extract_threads > 1)
+	{
+		u32 want = p->extract_threads < e.n_slots ? p->extract_threads : e.n_slots;
+		threads = wbfs_malloc(want * sizeof(*threads));
+		// with no thread at all the chunks are decrypted inline
+		while (threads && n_threads < want
+		       && pthread_create(&threads[n_threads], 0, extract_worker, &e) == 0)
+			n_threads++;
+	}
+#endif
+
+	file = first;
+	for (;;)
+	{
+		// read ahead as far as the free slots allow
+		while (more && rd - wr < e.n_slots)
+		{
+			if (!have)
+			{
+				while (file < last && f->e[file].is_dir)
+					file++;
+				if (file == last)
+				{
+					more = 0;
 					break;
+				}
+				block = ((u64)f->e[file].offset<<2) / 0x7c00;
+				end = f->e[file].size ? ((((u64)f->e[file].offset<<2) + f->e[file].size - 1) / 0x7c00) + 1 : block;
+				have = 1;
+			}
+			s = &e.slots[rd % e.n_slots];
+			s->file = file;
+			s->block = block;
+			s->n = end - block < EXTRACT_CHUNK ? end - block : EXTRACT_CHUNK;
+			if (s->n && wbfs_disc_read(d, f->partition_raw_offset + f->partition_data_offset
+						   + block * (0x8000>>2), s->raw, s->n * 0x8000))
+				ERROR("error reading disc");
+			block += s->n;
+			if (block == end)
+			{
+				have = 0;
+				file++;
 			}
+			rd++;
+			if (!n_threads)
+			{
+				extract_decrypt(f, s);
+				s->state = EXTRACT_DONE;
+				continue;
+			}
+#ifdef WBFS_THREADS
+			pthread_mutex_lock(&e.lock);
+			s->state = EXTRACT_READ;
+			pthread_cond_signal(&e.work);
+			pthread_mutex_unlock(&e.lock);
+#endif
 		}
+		if (wr == rd)
+			break;
+
+		// the oldest chunk goes to the callback
+		s = &e.slots[wr % e.n_slots];
+#ifdef WBFS_THREADS
+		if (n_threads)
+		{
+			pthread_mutex_lock(&e.lock);
+			while (s->state != EXTRACT_DONE)
+				pthread_cond_wait(&e.done, &e.lock);
+			pthread_mutex_unlock(&e.lock);
+		}
+#endif
+		{
+			wd_fst_entry_t *fe = &f->e[s->file];
+			u64 start = (u64)fe->offset<<2;
+			u64 lo = (u64)s->block * 0x7c00, hi = lo + s->n * 0x7c00;
+			u64 from = lo;
+			if (lo < start)
+				lo = start;
+			if (hi > start + fe->size)
+				hi = start + fe->size;
+			if (!s->n)
+				lo = hi = start;
+			if (named != s->file + 1)
+			{
+				if (wd_fst_path(f, s->file, name, EXTRACT_PATH_MAX))
+					ERROR("path too long");
+				named = s->file + 1;
+			}
+			if (write_dst_file(callback_data, name, lo - start, hi - lo, s->data + (lo - from)))
+				ERROR("error writing file");
+		}
+#ifdef WBFS_THREADS
+		pthread_mutex_lock(&e.lock);
+#endif
+		s->state = EXTRACT_FREE;
+#ifdef WBFS_THREADS
+		pthread_mutex_unlock(&e.lock);
+#endif
+		cur += s->n;
+		if (spinner)
+			spinner(cur, tot);
+		wr++;
 	}
-	wbfs_iofree(copy_buffer);
-	return 0;
+	ret = 0;
+
 error:
-	return 1;
+#ifdef WBFS_THREADS
+	pthread_mutex_lock(&e.lock);
+	e.stop = 1;
+	pthread_cond_broadcast(&e.work);
+	pthread_mutex_unlock(&e.lock);
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], 0);
+	pthread_cond_destroy(&e.done);
+	pthread_cond_destroy(&e.work);
+	pthread_mutex_destroy(&e.lock);
+	if (threads)
+		wbfs_free(threads);
+#endif
+	if (e.slots)
+	{
+		for (i = 0; i < e.n_slots; i++)
+		{
+			if (e.slots[i].raw)
+				wbfs_iofree(e.slots[i].raw);
+			if (e.slots[i].data)
+				wbfs_free(e.slots[i].data);
+		}
+		wbfs_free(e.slots);
+	}
+	if (name)
+		wbfs_free(name);
+	if (w)
+		wd_close_disc(w);
+	return ret;
 }
-	
-u32 wbfs_extract_file(wbfs_disc_t* d, char *path);
@@ -3,6 +3,9 @@
 
 #include "libwbfs_os.h" // this file is provided by the project wanting to compile libwbfs
 #include "wiidisc.h"
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
 #ifdef __cplusplus
    extern "C" {
@@ -75,7 +78,25 @@ typedef struct wbfs_disc_info
 typedef int (*rw_sector_callback_t)(void*fp,u32 lba,u32 count,void*iobuf);
 typedef void (*progress_callback_t)(int status,int total);
 typedef void (*close_callback_t)(void*fp);
+// count bytes at offset of the file path (from the root of the partition) being extracted
+typedef int (*write_file_callback_t)(void*fp,const char *path,u64 offset,u32 count,void*buf);
+
+
+// how wbfs_add_disc picks the blocks of a new disc
+typedef enum{
+        WBFS_ALLOC_FIRST_FIT=0,      // lowest free blocks
+        WBFS_ALLOC_NEXT_FIT,         // continue after the last allocated block
+        WBFS_ALLOC_BEST_FIT_EXTENT,  // smallest contiguous run that holds the whole disc
+}wbfs_alloc_policy_t;
 
+// when metadata changed by an add, remove, rename... goes to the disc
+typedef enum{
+        WBFS_FLUSH_EACH_OP=0,        // at the end of each operation
+        WBFS_FLUSH_EACH_OP_SYNC,     // same, then flush_hd is called too
+        WBFS_FLUSH_ON_SYNC,          // only in wbfs_sync() and wbfs_close()
+}wbfs_flush_policy_t;
+
+typedef struct wbfs_batch_s wbfs_batch_t;
 
 typedef struct wbfs_s
 {
@@ -103,25 +124,56 @@ typedef struct wbfs_s
         rw_sector_callback_t read_hdsector;
         rw_sector_callback_t write_hdsector;
 	close_callback_t close_hd;
+	close_callback_t flush_hd;      // optional, makes the writes so far durable
 
         void *callback_data;
 
         u16 max_disc;
         u32 freeblks_lba;
-        u32 *freeblks;
+        u32 *freeblks;          // host order, bit set means the block is free
+        u32 *freeblks_summary;  // bit i set when freeblks[i] != 0
+        u32 n_free_blks;        // number of bits set in freeblks
+        u32 freeblks_cursor;    // next-fit allocation restarts from here
+        wbfs_alloc_policy_t alloc_policy; // set after open, defaults to WBFS_ALLOC_BEST_FIT_EXTENT
+        u32 max_io_sz;          // largest single copy I/O in bytes, defaults to 8MB
+        u32 pipeline_mem;       // buffers for reading ahead while copying, defaults to 32MB.
+                                // less than two max_io_sz buffers copies without a reader thread
+        u32 io_depth;           // copy requests kept in flight, defaults to 1 (no async queue).
+                                // above 1 the callbacks may be called from several threads at once
+        u32 disc_cache_lines;   // 32KB lines cached by each disc handle opened after, defaults to 64, 0 for none
+        u32 disc_readahead;     // lines read at once on a miss of a sequential reader, defaults to 16
+        u32 extract_threads;    // threads decrypting for wbfs_extract_file, defaults to 4, 1 for none.
+                                // its buffers come out of pipeline_mem
         u16 disc_info_sz;
+        u8  *disc_info_img;     // all the disc_info blocks, read at open
+        u16 *disc_index;        // disc id hash -> slot+1, 0 for none
+        u32 disc_index_mask;
+        u32 *meta_dirty;        // one bit per hd sector of metadata not written yet
+        u32 meta_nlb;           // hd sectors from the head to the end of the free table
+        int meta_unflushed;     // metadata written since the last flush_hd
+        wbfs_flush_policy_t flush_policy; // defaults to WBFS_FLUSH_EACH_OP
+        wbfs_batch_t *batch;    // set between wbfs_begin_batch() and its commit or abort
 
-        u8  *tmp_buffer;  // pre-allocated buffer for unaligned read
-        
         u32 n_disc_open;
+#ifndef WIN32
+        pthread_rwlock_t lock;  // taken by the functions below, a wbfs_t can be shared by threads
+#endif
        
 }wbfs_t;
 
+typedef struct wbfs_disc_cache_s wbfs_disc_cache_t;
+
 typedef struct wbfs_disc_s
 {
         wbfs_t *p;
         wbfs_disc_info_t  *header;	  // pointer to wii header
         int i;		  		  // disc index in the wbfs header (disc_table)
+        u8  *tmp_buffer;		  // one hd sector for unaligned reads, a disc handle is used by one thread at a time
+        u16 *wlba;			  // header->wlba_table in host order
+        wbfs_disc_cache_t *cache;	  // wbfs_disc_read() cache, NULL for none
+        u32 cache_hits;			  // lines wbfs_disc_read() found in the cache
+        u32 cache_misses;		  // lines it had to read
+        u32 cache_readahead;		  // lines read ahead of a sequential reader
 }wbfs_disc_t;
 
 
@@ -142,7 +194,8 @@ wbfs_t * wbfs_open_hd(rw_sector_callback_t read_hdsector,
 						int hd_sector_size, int num_hd_sector, int reset);
 
 /*! @brief open a wbfs partition
-   @param read_hdsector,write_hdsector: accessors to the partition
+   @param read_hdsector,write_hdsector: accessors to the partition. write_hdsector may be NULL
+     to open the partition read-only: nothing is written and the write operations fail.
    @hd_sector_size: size of the hd sector. Can be set to zero if the partition in already initialized
    @num_hd_sector:  number of sectors in this partition. Can be set to zero if the partition in already initialized
    @partition_lba:  The partitio offset if you provided accessors to the whole disc.
@@ -160,6 +213,10 @@ wbfs_t*wbfs_open_partition(rw_sector_callback_t read_hdsector,
 /*! @brief close a wbfs partition, and sync the metadatas to the disc */
 void wbfs_close(wbfs_t*);
 
+/*! @brief write the metadata sectors that changed, then call flush_hd if anything
+  was written since the last flush */
+void wbfs_sync(wbfs_t*p);
+
 /*! @brief open a disc inside a wbfs partition use a 6 char discid+vendorid
   @return NULL if discid is not present
 */
@@ -187,6 +244,24 @@ u32 wbfs_count_discs(wbfs_t*p);
 */
 u32 wbfs_get_disc_info(wbfs_t*p, u32 i,u8 *header,int header_size,u32 *size); 
 
+/*! one disc in the list returned by wbfs_list_discs() */
+typedef struct wbfs_disc_entry_s
+{
+        char id[7];             // nul terminated
+        char title[0x3a];       // nul terminated, as shown by the loaders
+        u32 slot;               // index in disc_table
+        u32 n_blocks;           // wbfs sectors used on the partition
+        u32 n_fragments;        // runs of consecutive wbfs sectors
+        u32 size;               // n_blocks in 32bit words, like wbfs_get_disc_info()
+}wbfs_disc_entry_t;
+
+/*! list the discs of the partition, in the order of wbfs_get_disc_info(), in a single
+  pass over the metadata.
+  @param list: array that receives up to max entries. wbfs_count_discs() gives the size to allocate
+  @return the number of entries filled
+*/
+u32 wbfs_list_discs(wbfs_t*p, wbfs_disc_entry_t *list, u32 max);
+
 /*! get the number of used block of the partition.
   to be multiplied by p->wbfs_sec_sz (use 64bit multiplication) to have the number in bytes
 */
@@ -214,6 +289,9 @@ u32 wbfs_count_added_disc_blocks(wbfs_t*p,
 	// It's a bit silly to fidef this... - g3power
   @new_name: different name for imported ISO. NULL to use default name from ISO header
 #endif
+  @return 0 once the disc is in the partition, 1 if the add failed or was cancelled.
+  On failure the blocks taken for the disc are free again and no slot is used; in a
+  batch the earlier operations are kept, call wbfs_abort_batch() to drop them too.
  */
 u32 wbfs_add_disc(wbfs_t*p,read_wiidisc_callback_t read_src_wii_disc, 
 					void *callback_data,
@@ -223,6 +301,18 @@ u32 wbfs_add_disc(wbfs_t*p,read_wiidisc_callback_t read_src_wii_disc,
 					char *new_name
 					);
 
+/*! same as wbfs_add_disc, with the usage of the source disc already built by
+  wd_build_disc_usage() for sel, so the disc is not scanned again.
+  @return 0 on success, 1 on failure or cancel, as wbfs_add_disc.
+ */
+u32 wbfs_add_disc_usage(wbfs_t*p,read_wiidisc_callback_t read_src_wii_disc,
+					void *callback_data,
+					progress_callback_t spinner,
+					partition_selector_t sel,
+					const u32 *usage,
+					char *new_name
+					);
+
 u32 wbfs_estimate_disc(wbfs_t*p,read_wiidisc_callback_t read_src_wii_disc, void *callback_data,
                   partition_selector_t sel);
 
@@ -240,6 +330,27 @@ u32 wbfs_nid_disc(wbfs_t*p, u8* discid, u8* newid);
  */
 u32 wbfs_trim(wbfs_t*p);
 
+/*! @brief start a batch of add, remove, rename and id changes.
+  Nothing goes to the metadata on the disc until wbfs_commit(), whatever the flush
+  policy, and blocks freed by a remove can be used by the next add at once.
+  There is one batch at a time, and no disc may be open at commit or abort.
+  @return 0 on success
+*/
+u32 wbfs_begin_batch(wbfs_t*p);
+
+/*! @brief end the batch: flush the data written so far, then write every changed
+  metadata sector in one ordered pass and flush again.
+  @return 0 on success
+*/
+u32 wbfs_commit(wbfs_t*p);
+
+/*! @brief end the batch and bring the metadata back to its state at wbfs_begin_batch().
+  Discs added in the batch are gone and their blocks free again. A disc removed in the
+  batch comes back, unless an add of the batch already overwrote some of its blocks:
+  then it stays removed. wbfs_close() aborts a batch that is still open.
+*/
+void wbfs_abort_batch(wbfs_t*p);
+
 /*! extract a disc from the wbfs, unused sectors are just untouched, allowing descent filesystem to only really usefull space to store the disc.
 Even if the filesize is 4.7GB, the disc usage will be less.
  */
@@ -247,8 +358,13 @@ u32 wbfs_extract_disc(wbfs_disc_t*d, rw_sector_callback_t write_dst_wii_sector,v
 
 /*! extract a file from the wii disc filesystem. 
   E.G. Allows to extract the opening.bnr to install a game as a system menu channel
+  @path: a file or directory of the game partition, see wd_fst_find_file(). all the files
+  inside a directory are extracted.
+  @write_dst_file: gets the data of each file in order, an empty file gets one call with count 0.
+  it is only called from the calling thread.
+  @return 0 on success
  */
-u32 wbfs_extract_file(wbfs_disc_t*d, char *path);
+u32 wbfs_extract_file(wbfs_disc_t*d, char *path, write_file_callback_t write_dst_file,void *callback_data,progress_callback_t spinner);
 
 // remove some sanity checks
 void wbfs_set_force_mode(int force);
@@ -256,17 +372,44 @@ void wbfs_set_force_mode(int force);
 
 /* OS specific functions provided by libwbfs_<os>.c */
 
-wbfs_t *wbfs_try_open(char *disk, char *partition, int reset);
-wbfs_t *wbfs_try_open_partition(char *fn, int reset);
+// mode of the wbfs_try_open functions
+#define WBFS_OPEN_RW            0
+#define WBFS_OPEN_RESET         1       // format an empty wbfs
+#define WBFS_OPEN_READ_ONLY     2       // open the device read-only and never write to it.
+                                        // any number of read-only users may share a device,
+                                        // a read-write one has it to itself
+
+wbfs_t *wbfs_try_open(char *disk, char *partition, int mode);
+wbfs_t *wbfs_try_open_partition(char *fn, int mode);
 
 void *wbfs_open_file_for_read(char*filename);
 void *wbfs_open_file_for_write(char*filename);
 int wbfs_read_file(void*handle, int len, void *buf);
 void wbfs_close_file(void *handle);
+void wbfs_file_set_cancel(void *handle, int *cancel);
+void wbfs_set_direct_io(int direct);
+void *wbfs_map_sector(rw_sector_callback_t io, void *data, u32 lba, u32 count);
+int wbfs_clone_sectors(rw_sector_callback_t src_io, void *src, u32 src_lba, u32 src_count,
+		       rw_sector_callback_t dst_io, void *dst, u32 dst_lba, u32 dst_count);
+
+// asynchronous requests. submit queues a call of io(data,lba,count,buf)
+// and returns at once, wait blocks until one request is done, gives back
+// its tag and returns what io would have returned. At most depth requests
+// may be in flight. Requests on the handles above go straight to the
+// kernel when it can, others run on a pool of threads.
+typedef struct wbfs_aio_s wbfs_aio_t;
+wbfs_aio_t *wbfs_aio_open(int depth);
+int wbfs_aio_submit(wbfs_aio_t *q, rw_sector_callback_t io, void *data, u32 lba, u32 count, void *buf, void *tag);
+int wbfs_aio_wait(wbfs_aio_t *q, void **tag);
+void wbfs_aio_close(wbfs_aio_t *q);
 void wbfs_file_reserve_space(void*handle,long long size);
 void wbfs_file_truncate(void *handle,long long size);
 int wbfs_read_wii_file(void *_handle, u32 _offset, u32 count, void *buf);
 int wbfs_write_wii_sector_file(void *_handle, u32 lba, u32 count, void *buf);
+// a write_file_callback_t storing the files under a directory
+void *wbfs_open_dir_for_write(char *dirname);
+int wbfs_write_dir_file(void *_handle, const char *path, u64 offset, u32 count, void *buf);
+int wbfs_close_dir(void *handle);
 
 
 #ifdef __cplusplus
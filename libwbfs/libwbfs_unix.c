@@ -1,4 +1,7 @@
 #if defined( __linux__) || defined(__APPLE__) || defined(__CYGWIN__)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	// O_DIRECT
+#endif
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -12,119 +15,861 @@
 #endif
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
 
 #include "libwbfs.h"
 
-void *wbfs_open_file_for_read(char*filename)
+#ifdef POSIX_FADV_NORMAL
+#define HAVE_FADVISE
+#else
+#define POSIX_FADV_NORMAL 0
+#define POSIX_FADV_SEQUENTIAL 0
+#endif
+
+// files and devices are plain descriptors accessed with positional
+// reads and writes, so one handle may be shared between threads.
+// In direct mode a second descriptor bypasses the page cache for the
+// requests that are aligned for it, the others still go through fd.
+typedef struct wbfs_file_s
 {
-        FILE*f = fopen(filename,"r");
+	int fd;
+	int dfd;	// O_DIRECT descriptor or -1
+	int *cancel;
+	u8 *map;	// whole file mapped read-only, or NULL
+	u64 map_len;
+}wbfs_file_t;
+
+#define WBFS_DIRECT_ALIGN 4096
+
+static int wbfs_direct_io = 0;
+
+// files and devices opened after this bypass the page cache where possible
+void wbfs_set_direct_io(int direct)
+{
+	wbfs_direct_io = direct;
+}
+
+static wbfs_file_t *wbfs_fd_open(char *filename, int flags, int advice)
+{
+	wbfs_file_t *f;
+	int fd = open(filename, flags, 0666);
+	if (fd < 0)
+		return 0;
+	f = wbfs_malloc(sizeof(*f));
 	if (!f)
-		wbfs_fatal("unable to open file\n");
-        return (void*)f;
+	{
+		close(fd);
+		return 0;
+	}
+	f->fd = fd;
+	f->dfd = -1;
+	f->cancel = 0;
+	f->map = 0;
+	f->map_len = 0;
+#ifdef O_DIRECT
+	// not every filesystem takes it, then we just stay buffered
+	if (wbfs_direct_io)
+		f->dfd = open(filename, (flags & ~(O_CREAT|O_TRUNC)) | O_DIRECT);
+#endif
+#ifdef HAVE_FADVISE
+	posix_fadvise(fd, 0, 0, advice);
+#endif
+	// regular files we read from are also mapped, unless the page cache
+	// is to be avoided. Nothing is read until a copy touches the pages.
+	if ((flags & O_ACCMODE) != O_WRONLY && f->dfd < 0 && !wbfs_direct_io)
+	{
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+		    && (u64)st.st_size == (size_t)st.st_size)
+		{
+			f->map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (f->map == MAP_FAILED)
+				f->map = 0;
+			else
+				f->map_len = st.st_size;
+		}
+	}
+	return f;
+}
+static int wbfs_fd_close(wbfs_file_t *f)
+{
+	int ret;
+	if (f->map)
+		munmap(f->map, f->map_len);
+	if (f->dfd >= 0)
+		close(f->dfd);
+	ret = close(f->fd);
+	wbfs_free(f);
+	return ret;
+}
+static int wbfs_fd_pick(wbfs_file_t *f, void *buf, u64 len, u64 off)
+{
+	if (f->dfd >= 0 && !(((size_t)buf | len | off) & (WBFS_DIRECT_ALIGN-1)))
+		return f->dfd;
+	return f->fd;
+}
+static int wbfs_fd_pread(wbfs_file_t *f, void *buf, u64 len, u64 off)
+{
+	u8 *ptr = buf;
+	while (len)
+	{
+		ssize_t ret = pread(wbfs_fd_pick(f, ptr, len, off), ptr, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 1;
+		ptr += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+static int wbfs_fd_pwrite(wbfs_file_t *f, void *buf, u64 len, u64 off)
+{
+	u8 *ptr = buf;
+	while (len)
+	{
+		ssize_t ret = pwrite(wbfs_fd_pick(f, ptr, len, off), ptr, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 1;
+		ptr += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+void *wbfs_open_file_for_read(char*filename)
+{
+	// NULL when the file can't be opened, the caller reports it
+	return (void*)wbfs_fd_open(filename, O_RDONLY, POSIX_FADV_SEQUENTIAL);
 }
 void *wbfs_open_file_for_write(char*filename)
 {
-        FILE*f = fopen(filename,"w");
-	if (!f)
-		wbfs_fatal("unable to open file\n");
-        return (void*)f;
+	return (void*)wbfs_fd_open(filename, O_WRONLY|O_CREAT|O_TRUNC, POSIX_FADV_NORMAL);
+}
+// let a caller abort long transfers on this handle: reads and writes
+// fail as soon as *cancel becomes non zero
+void wbfs_file_set_cancel(void *handle, int *cancel)
+{
+	((wbfs_file_t*)handle)->cancel = cancel;
 }
 int wbfs_read_file(void*handle, int len, void *buf)
 {
-        return fread(buf,len,1,(FILE*)handle);
+	wbfs_file_t *f = handle;
+	ssize_t ret;
+	do
+		ret = read(f->fd, buf, len);
+	while (ret < 0 && errno == EINTR);
+	return ret == len;
 }
 void wbfs_close_file(void *handle)
 {
-        fclose((FILE*)handle);
+	wbfs_fd_close(handle);
 }
 void wbfs_file_reserve_space(void*handle, long long size)
 {
-        FILE*f=(FILE*)handle;
-        fseeko(f, size-1ULL, SEEK_SET);
-        fwrite("", 1, 1, f);
+	wbfs_file_t *f = handle;
+	struct stat st;
+	if (fstat(f->fd, &st) == 0 && st.st_size < size)
+		ftruncate(f->fd, size);
 }
 void wbfs_file_truncate(void *handle,long long size)
 {
-        ftruncate(fileno((FILE*)handle),size);
+	ftruncate(((wbfs_file_t*)handle)->fd, size);
 }
 int wbfs_read_wii_file(void*_fp,u32 offset,u32 count,void*iobuf)
 {
-	FILE*fp =_fp;
+	wbfs_file_t *f = _fp;
 	u64 off = offset;
 	off<<=2;
 
-	if (fseeko(fp, off, SEEK_SET))
+	if (f->cancel && *f->cancel)
+		return 1;
+	if (wbfs_fd_pread(f, iobuf, count, off))
 	{
-		wbfs_error("error seeking in disc file (%ld)",off);
-                return 1;
-        }
-        if (fread(iobuf, count, 1, fp) != 1){
-                wbfs_error("error reading disc");
-                return 1;
+		wbfs_error("error reading disc");
+		return 1;
 	}
 	return 0;
 }
 
 int wbfs_write_wii_sector_file(void*_fp,u32 lba,u32 count,void*iobuf)
 {
-	FILE*fp=_fp;
+	wbfs_file_t *f = _fp;
 	u64 off = lba;
 	off *=0x8000;
 
-	if (fseeko(fp, off, SEEK_SET))
-        {
-		wbfs_error("error seeking in disc file (%lld)",off);
-                return 1;
-        }
-        if (fwrite(iobuf, count*0x8000, 1, fp) != 1){
-                wbfs_error("error writing disc file");
-                return 1;
-        }
-        return 0;
+	if (f->cancel && *f->cancel)
+		return 1;
+	if (wbfs_fd_pwrite(f, iobuf, count*0x8000ULL, off))
+	{
+		wbfs_error("error writing disc file");
+		return 1;
+	}
+	return 0;
+}
+
+// extracted files are stored under dir, the one being written stays open
+typedef struct wbfs_dir_s
+{
+	char *dir;
+	char *path;	// of the open file, NULL for none
+	wbfs_file_t *f;
+}wbfs_dir_t;
+
+void *wbfs_open_dir_for_write(char*dirname)
+{
+	wbfs_dir_t *d;
+	struct stat st;
+	if (mkdir(dirname, 0777) != 0 && errno != EEXIST)
+		return 0;
+	if (stat(dirname, &st) != 0 || !S_ISDIR(st.st_mode))
+		return 0;
+	d = wbfs_malloc(sizeof(*d));
+	if (!d)
+		return 0;
+	d->dir = wbfs_malloc(strlen(dirname) + 1);
+	if (!d->dir)
+	{
+		wbfs_free(d);
+		return 0;
+	}
+	strcpy(d->dir, dirname);
+	d->path = 0;
+	d->f = 0;
+	return d;
+}
+static int wbfs_dir_close_file(wbfs_dir_t *d)
+{
+	int ret = 0;
+	if (d->f && wbfs_fd_close(d->f) != 0)
+		ret = 1;
+	d->f = 0;
+	wbfs_free(d->path);
+	d->path = 0;
+	return ret;
+}
+// the names come from the disc, none of them may leave dir
+static int wbfs_dir_open_file(wbfs_dir_t *d, const char *path)
+{
+	char *full, *c, *name;
+	size_t len = strlen(d->dir) + strlen(path) + 2;
+	full = wbfs_malloc(len);
+	if (!full)
+		return 1;
+	snprintf(full, len, "%s/%s", d->dir, path);
+	name = full + strlen(d->dir) + 1;
+	for (c = name; ; c++)
+	{
+		if (*c != '/' && *c)
+			continue;
+		if (c == name || (c - name == 1 && name[0] == '.')
+		    || (c - name == 2 && name[0] == '.' && name[1] == '.'))
+		{
+			wbfs_error("bad file name %s", path);
+			wbfs_free(full);
+			return 1;
+		}
+		if (!*c)
+			break;
+		*c = 0;
+		mkdir(full, 0777);
+		*c = '/';
+		name = c + 1;
+	}
+	d->f = wbfs_fd_open(full, O_WRONLY|O_CREAT|O_TRUNC, POSIX_FADV_NORMAL);
+	if (!d->f)
+		wbfs_error("unable to create %s", full);
+	wbfs_free(full);
+	if (!d->f)
+		return 1;
+	d->path = wbfs_malloc(strlen(path) + 1);
+	if (!d->path)
+	{
+		wbfs_dir_close_file(d);
+		return 1;
+	}
+	strcpy(d->path, path);
+	return 0;
+}
+int wbfs_write_dir_file(void *_handle, const char *path, u64 offset, u32 count, void *buf)
+{
+	wbfs_dir_t *d = _handle;
+	while (*path == '/')
+		path++;
+	if (!d->path || strcmp(d->path, path))
+	{
+		if (wbfs_dir_close_file(d))
+		{
+			wbfs_error("error closing extracted file");
+			return 1;
+		}
+		if (wbfs_dir_open_file(d, path))
+			return 1;
+	}
+	if (count && wbfs_fd_pwrite(d->f, buf, count, offset))
+	{
+		wbfs_error("error writing extracted file");
+		return 1;
+	}
+	return 0;
+}
+int wbfs_close_dir(void *handle)
+{
+	wbfs_dir_t *d = handle;
+	int ret = wbfs_dir_close_file(d);
+	wbfs_free(d->dir);
+	wbfs_free(d);
+	return ret;
 }
 
 static int wbfs_fread_sector(void *_fp,u32 lba,u32 count,void*buf)
 {
-	FILE*fp =_fp;
 	u64 off = lba;
 	off*=512ULL;
-	if (fseeko(fp, off, SEEK_SET))
+	if (wbfs_fd_pread(_fp, buf, count*512ULL, off))
 	{
-		fprintf(stderr,"\n\n%lld %d %p\n",off,count,_fp);
-		wbfs_error("error seeking in disc partition");
-		return 1;
-	}
-	if (fread(buf, count*512ULL, 1, fp) != 1){
 		wbfs_error("error reading disc");
 		return 1;
 	}
 	return 0;
-  
 }
 static int wbfs_fwrite_sector(void *_fp,u32 lba,u32 count,void*buf)
 {
-	FILE*fp =_fp;
 	u64 off = lba;
 	off*=512ULL;
-	if (fseeko(fp, off, SEEK_SET))
+	if (wbfs_fd_pwrite(_fp, buf, count*512ULL, off))
 	{
-		wbfs_error("error seeking in disc file");
-		return 1;
-	}
-	if (fwrite(buf, count*512ULL, 1, fp) != 1){
 		wbfs_error("error writing disc");
 		return 1;
 	}
 	return 0;
-  
 }
 static void wbfs_fclose(void *_fp)
 {
-	FILE*fp =_fp;
-	if (fclose(fp) != 0) {
+	if (wbfs_fd_close(_fp) != 0) {
 		wbfs_error("error closing disc");
 	}
 }
+static void wbfs_fflush(void *_fp)
+{
+	wbfs_file_t *f = _fp;
+	if (fdatasync(f->fd) != 0) {
+		wbfs_error("error flushing disc");
+	}
+}
+// the handle and byte range behind a request on one of our own
+// callbacks, NULL for any other callback
+static wbfs_file_t *wbfs_fd_request(rw_sector_callback_t io, void *data, u32 lba, u32 count,
+				    int *write, u64 *off, u64 *len)
+{
+	*write = 0;
+	*off = *len = 0;
+	if (io == wbfs_read_wii_file) {
+		*write = 0;
+		*off = (u64)lba << 2;
+		*len = count;
+	} else if (io == wbfs_write_wii_sector_file) {
+		*write = 1;
+		*off = lba * 0x8000ULL;
+		*len = count * 0x8000ULL;
+	} else if (io == wbfs_fread_sector || io == wbfs_fwrite_sector) {
+		*write = io == wbfs_fwrite_sector;
+		*off = lba * 512ULL;
+		*len = count * 512ULL;
+	} else
+		return 0;
+	return data;
+}
+
+// what a read through io would return, straight from the mapping of a
+// regular file, so a copy can write from it without a read. NULL when
+// the handle isn't mapped, the range is past its end, or it's cancelled.
+void *wbfs_map_sector(rw_sector_callback_t io, void *data, u32 lba, u32 count)
+{
+	wbfs_file_t *f;
+	u64 off, len, start;
+	int write;
+
+	f = wbfs_fd_request(io, data, lba, count, &write, &off, &len);
+	if (!f || write || !f->map || off + len > f->map_len)
+		return 0;
+	if (f->cancel && *f->cancel)
+		return 0;
+	start = off & ~(u64)(WBFS_DIRECT_ALIGN-1);
+	madvise(f->map + start, off + len - start, MADV_SEQUENTIAL);
+	return f->map + off;
+}
+
+// copy a read through src_io into a write through dst_io without
+// moving the data through user space: shared extents when the
+// filesystem can clone, else an in-kernel copy. Returns 1 when that's
+// not possible for these handles, nothing is lost then but time.
+int wbfs_clone_sectors(rw_sector_callback_t src_io, void *src, u32 src_lba, u32 src_count,
+		       rw_sector_callback_t dst_io, void *dst, u32 dst_lba, u32 dst_count)
+{
+	wbfs_file_t *fs, *fd;
+	u64 soff, slen, doff, dlen;
+	int swrite, dwrite;
+
+	fs = wbfs_fd_request(src_io, src, src_lba, src_count, &swrite, &soff, &slen);
+	fd = wbfs_fd_request(dst_io, dst, dst_lba, dst_count, &dwrite, &doff, &dlen);
+	if (!fs || !fd || swrite || !dwrite || slen != dlen)
+		return 1;
+	if ((fs->cancel && *fs->cancel) || (fd->cancel && *fd->cancel))
+		return 1;
+#ifdef FICLONERANGE
+	{
+		struct file_clone_range r;
+		r.src_fd = fs->fd;
+		r.src_offset = soff;
+		r.src_length = slen;
+		r.dest_offset = doff;
+		if (ioctl(fd->fd, FICLONERANGE, &r) == 0)
+			return 0;
+	}
+#endif
+#ifdef __NR_copy_file_range
+	while (slen)
+	{
+		loff_t in = soff, out = doff;
+		long ret = syscall(__NR_copy_file_range, fs->fd, &in, fd->fd, &out, (size_t)slen, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 1;
+		soff += ret;
+		doff += ret;
+		slen -= ret;
+	}
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+// asynchronous requests
+//
+// Requests on our own descriptors go to an io_uring when the kernel has
+// one, everything else runs on a small pool of threads started on first
+// use. With a ring, finished pool requests post a NOP to it, so that
+// wbfs_aio_wait() can wait for the ring while anything is posted to it.
+// A request the ring does not take goes to the pool, and a ring that
+// keeps failing is given up: what was posted to it fails.
+
+enum { AIO_FREE, AIO_QUEUED, AIO_BUSY, AIO_DONE };
+
+typedef struct wbfs_aio_req_s
+{
+	rw_sector_callback_t io;
+	void *data;
+	u32 lba;
+	u32 count;
+	void *buf;
+	void *tag;
+	int state;
+	int ret;
+	u32 seq;
+	int posted;	// a completion for it is due on the ring
+	// set when the request goes to the ring
+	wbfs_file_t *f;
+	int write;
+	u64 off;
+	u64 len;
+	u64 done;
+}wbfs_aio_req_t;
+
+struct wbfs_aio_s
+{
+	int depth;
+	wbfs_aio_req_t *reqs;
+	u32 seq;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t finished;
+	pthread_t *threads;
+	int n_threads;
+	int quit;
+	int ring_posted;	// requests with posted set
+#ifdef HAVE_IO_URING
+	int ring_fd;
+	int ring_failed;
+	u8 *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+#endif
+};
+
+#ifdef HAVE_IO_URING
+// the kernel can do requests on our own callbacks itself
+static int aio_fd_request(wbfs_aio_req_t *r)
+{
+	r->f = wbfs_fd_request(r->io, r->data, r->lba, r->count, &r->write, &r->off, &r->len);
+	r->done = 0;
+	return r->f != 0;
+}
+
+static int aio_ring_open(wbfs_aio_t *q)
+{
+	struct io_uring_params par;
+	u8 *sqes;
+
+	memset(&par, 0, sizeof(par));
+	q->ring_fd = syscall(__NR_io_uring_setup, q->depth, &par);
+	if (q->ring_fd < 0)
+		return 1;
+	// IORING_OP_READ and IORING_OP_WRITE came with this feature
+	if (!(par.features & IORING_FEAT_RW_CUR_POS))
+		goto fail;
+	q->sq_ring_sz = par.sq_off.array + par.sq_entries * sizeof(unsigned);
+	q->cq_ring_sz = par.cq_off.cqes + par.cq_entries * sizeof(struct io_uring_cqe);
+	if (par.features & IORING_FEAT_SINGLE_MMAP) {
+		if (q->cq_ring_sz > q->sq_ring_sz)
+			q->sq_ring_sz = q->cq_ring_sz;
+		q->cq_ring_sz = 0;
+	}
+	q->sq_ring = mmap(0, q->sq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			  q->ring_fd, IORING_OFF_SQ_RING);
+	if (q->sq_ring == MAP_FAILED)
+		goto fail;
+	q->cq_ring = q->sq_ring;
+	if (q->cq_ring_sz) {
+		q->cq_ring = mmap(0, q->cq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+				  q->ring_fd, IORING_OFF_CQ_RING);
+		if (q->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+	q->sqes_sz = par.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(0, q->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    q->ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto fail_cq;
+	q->sqes = (struct io_uring_sqe *)sqes;
+	q->sq_tail = (unsigned *)(q->sq_ring + par.sq_off.tail);
+	q->sq_mask = (unsigned *)(q->sq_ring + par.sq_off.ring_mask);
+	q->sq_array = (unsigned *)(q->sq_ring + par.sq_off.array);
+	q->cq_head = (unsigned *)(q->cq_ring + par.cq_off.head);
+	q->cq_tail = (unsigned *)(q->cq_ring + par.cq_off.tail);
+	q->cq_mask = (unsigned *)(q->cq_ring + par.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)(q->cq_ring + par.cq_off.cqes);
+	return 0;
+fail_cq:
+	if (q->cq_ring_sz)
+		munmap(q->cq_ring, q->cq_ring_sz);
+fail_sq:
+	munmap(q->sq_ring, q->sq_ring_sz);
+fail:
+	close(q->ring_fd);
+	q->ring_fd = -1;
+	return 1;
+}
+
+static void aio_ring_close(wbfs_aio_t *q)
+{
+	if (q->ring_fd < 0)
+		return;
+	munmap(q->sqes, q->sqes_sz);
+	if (q->cq_ring_sz)
+		munmap(q->cq_ring, q->cq_ring_sz);
+	munmap(q->sq_ring, q->sq_ring_sz);
+	close(q->ring_fd);
+}
+
+static int aio_ring_usable(wbfs_aio_t *q)
+{
+	return q->ring_fd >= 0 && !q->ring_failed;
+}
+
+static int aio_ring_transient(int err)
+{
+	return err == EINTR || err == EAGAIN || err == EBUSY;
+}
+
+// queue the rest of a ring request, or a NOP telling that a pool request
+// is done. Called with the lock held. Returns 1 if the kernel did not
+// take it, and then nothing is left in the submission queue.
+static int aio_ring_push(wbfs_aio_t *q, wbfs_aio_req_t *r)
+{
+	unsigned tail = *q->sq_tail, idx = tail & *q->sq_mask;
+	struct io_uring_sqe *sqe = &q->sqes[idx];
+	u64 len;
+	int ret;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = r - q->reqs;
+	if (r->f) {
+		len = r->len - r->done;
+		if (len > 1U<<30)
+			len = 1U<<30;
+		sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = wbfs_fd_pick(r->f, (u8 *)r->buf + r->done, len, r->off + r->done);
+		sqe->addr = (u64)(size_t)((u8 *)r->buf + r->done);
+		sqe->len = len;
+		sqe->off = r->off + r->done;
+	} else
+		sqe->opcode = IORING_OP_NOP;
+	q->sq_array[idx] = idx;
+	__atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	while ((ret = syscall(__NR_io_uring_enter, q->ring_fd, 1, 0, 0, 0, 0)) < 0
+	       && aio_ring_transient(errno))
+		;
+	if (ret != 1)
+	{
+		// the kernel only reads the queue in io_uring_enter
+		__atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+		return 1;
+	}
+	if (!r->posted) {
+		r->posted = 1;
+		q->ring_posted++;
+	}
+	return 0;
+}
+
+// the ring can't be waited on: fail every request posted to it
+static void aio_ring_fail(wbfs_aio_t *q)
+{
+	wbfs_aio_req_t *r;
+	int i;
+
+	wbfs_error("asynchronous i/o failed");
+	q->ring_failed = 1;
+	for (i = 0; i < q->depth; i++) {
+		r = &q->reqs[i];
+		if (!r->posted)
+			continue;
+		if (r->f) {
+			r->ret = 1;
+			r->state = AIO_DONE;
+		}
+		r->posted = 0;
+	}
+	q->ring_posted = 0;
+}
+
+// wait for one ring completion and account for it. Called with the lock
+// held, which is dropped while waiting.
+static void aio_ring_reap(wbfs_aio_t *q)
+{
+	unsigned head = *q->cq_head;
+	struct io_uring_cqe *cqe;
+	wbfs_aio_req_t *r;
+	int err, res;
+
+	while (head == __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&q->lock);
+		err = 0;
+		if (syscall(__NR_io_uring_enter, q->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0)
+			err = errno;
+		pthread_mutex_lock(&q->lock);
+		if (err && !aio_ring_transient(err)) {
+			aio_ring_fail(q);
+			return;
+		}
+	}
+	cqe = &q->cqes[head & *q->cq_mask];
+	r = &q->reqs[cqe->user_data];
+	res = cqe->res;
+	__atomic_store_n(q->cq_head, head + 1, __ATOMIC_RELEASE);
+	if (r->f) {
+		if (res > 0)
+			r->done += res;
+		if ((res == -EINTR || res == -EAGAIN || (res > 0 && r->done < r->len))
+		    && !aio_ring_push(q, r))
+			return;
+		r->ret = r->done != r->len;
+		if (r->ret)
+			wbfs_error(r->write ? "error writing disc" : "error reading disc");
+		r->state = AIO_DONE;
+	}
+	r->posted = 0;
+	q->ring_posted--;
+}
+#endif
+
+static void *aio_worker(void *_q)
+{
+	wbfs_aio_t *q = _q;
+	wbfs_aio_req_t *r;
+	int i, ret;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		// oldest queued request first, so the device sees them in order
+		r = 0;
+		for (i = 0; i < q->depth; i++)
+			if (q->reqs[i].state == AIO_QUEUED && (!r || (int)(q->reqs[i].seq - r->seq) < 0))
+				r = &q->reqs[i];
+		if (!r) {
+			if (q->quit)
+				break;
+			pthread_cond_wait(&q->queued, &q->lock);
+			continue;
+		}
+		r->state = AIO_BUSY;
+		pthread_mutex_unlock(&q->lock);
+		ret = r->io(r->data, r->lba, r->count, r->buf);
+		pthread_mutex_lock(&q->lock);
+		r->ret = ret;
+		r->state = AIO_DONE;
+#ifdef HAVE_IO_URING
+		if (aio_ring_usable(q))
+			aio_ring_push(q, r);
+#endif
+		// also when a NOP was posted, the waiter may not be on the ring
+		pthread_cond_signal(&q->finished);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+wbfs_aio_t *wbfs_aio_open(int depth)
+{
+	wbfs_aio_t *q;
+
+	if (depth < 1)
+		depth = 1;
+	q = wbfs_malloc(sizeof(*q));
+	if (!q)
+		return 0;
+	memset(q, 0, sizeof(*q));
+	q->depth = depth;
+	q->reqs = wbfs_malloc(depth * sizeof(*q->reqs));
+	q->threads = wbfs_malloc(depth * sizeof(*q->threads));
+	if (!q->reqs || !q->threads) {
+		wbfs_free(q->reqs);
+		wbfs_free(q->threads);
+		wbfs_free(q);
+		return 0;
+	}
+	memset(q->reqs, 0, depth * sizeof(*q->reqs));
+	pthread_mutex_init(&q->lock, 0);
+	pthread_cond_init(&q->queued, 0);
+	pthread_cond_init(&q->finished, 0);
+#ifdef HAVE_IO_URING
+	aio_ring_open(q);
+#endif
+	return q;
+}
+
+int wbfs_aio_submit(wbfs_aio_t *q, rw_sector_callback_t io, void *data, u32 lba, u32 count, void *buf, void *tag)
+{
+	wbfs_aio_req_t *r = 0;
+	int i;
+
+	pthread_mutex_lock(&q->lock);
+	for (i = 0; i < q->depth; i++)
+		if (q->reqs[i].state == AIO_FREE) {
+			r = &q->reqs[i];
+			break;
+		}
+	if (!r)
+		goto fail;
+	r->io = io;
+	r->data = data;
+	r->lba = lba;
+	r->count = count;
+	r->buf = buf;
+	r->tag = tag;
+	r->f = 0;
+	r->posted = 0;
+#ifdef HAVE_IO_URING
+	if (aio_ring_usable(q) && aio_fd_request(r)) {
+		if (r->f->cancel && *r->f->cancel)
+			goto fail;
+		r->state = AIO_BUSY;
+		if (!aio_ring_push(q, r)) {
+			pthread_mutex_unlock(&q->lock);
+			return 0;
+		}
+		// not taken by the kernel, the pool does it instead
+		r->state = AIO_FREE;
+	}
+	r->f = 0;
+#endif
+	// one more worker for each request in flight, up to depth
+	if (q->n_threads < q->depth) {
+		int busy = 0;
+		for (i = 0; i < q->depth; i++)
+			busy += q->reqs[i].state == AIO_QUEUED || q->reqs[i].state == AIO_BUSY;
+		if (busy >= q->n_threads && pthread_create(&q->threads[q->n_threads], 0, aio_worker, q) == 0)
+			q->n_threads++;
+		if (!q->n_threads)
+			goto fail;
+	}
+	r->state = AIO_QUEUED;
+	r->seq = q->seq++;
+	pthread_cond_signal(&q->queued);
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+fail:
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+int wbfs_aio_wait(wbfs_aio_t *q, void **tag)
+{
+	wbfs_aio_req_t *r = 0;
+	int i, ret;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		for (i = 0; i < q->depth && !r; i++)
+			if (q->reqs[i].state == AIO_DONE && !q->reqs[i].posted)
+				r = &q->reqs[i];
+		if (r)
+			break;
+#ifdef HAVE_IO_URING
+		if (q->ring_posted) {
+			aio_ring_reap(q);
+			continue;
+		}
+#endif
+		pthread_cond_wait(&q->finished, &q->lock);
+	}
+	*tag = r->tag;
+	ret = r->ret;
+	r->state = AIO_FREE;
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+void wbfs_aio_close(wbfs_aio_t *q)
+{
+	int i;
+
+	pthread_mutex_lock(&q->lock);
+	q->quit = 1;
+	pthread_cond_broadcast(&q->queued);
+	pthread_mutex_unlock(&q->lock);
+	for (i = 0; i < q->n_threads; i++)
+		pthread_join(q->threads[i], 0);
+#ifdef HAVE_IO_URING
+	aio_ring_close(q);
+#endif
+	pthread_cond_destroy(&q->finished);
+	pthread_cond_destroy(&q->queued);
+	pthread_mutex_destroy(&q->lock);
+	wbfs_free(q->threads);
+	wbfs_free(q->reqs);
+	wbfs_free(q);
+}
+
 static int get_capacity(char *file,u32 *sector_size,u32 *n_sector)
 {
 	int fd = open(file,O_RDONLY);
@@ -172,35 +917,65 @@ static int get_capacity(char *file,u32 *sector_size,u32 *n_sector)
 		*n_sector/=512/ *sector_size;
 	return 1;
 }
-wbfs_t *wbfs_try_open_hd(char *fn,int reset)
+// the device for wbfs_try_open_*(): read-only users share it, a
+// read-write one needs it alone. The lock is advisory, between
+// programs using libwbfs.
+static wbfs_file_t *wbfs_open_device(char *fn, int mode)
+{
+	int ro = mode == WBFS_OPEN_READ_ONLY;
+	wbfs_file_t *f = wbfs_fd_open(fn, ro ? O_RDONLY : O_RDWR, POSIX_FADV_NORMAL);
+	if (!f)
+		return NULL;
+	if (flock(f->fd, (ro ? LOCK_SH : LOCK_EX) | LOCK_NB) != 0 && errno == EWOULDBLOCK)
+	{
+		wbfs_error("device is in use by another program");
+		wbfs_fd_close(f);
+		return NULL;
+	}
+	return f;
+}
+wbfs_t *wbfs_try_open_hd(char *fn,int mode)
 {
 	u32 sector_size, n_sector;
 	if(!get_capacity(fn,&sector_size,&n_sector))
 		return NULL;
-	FILE *f = fopen(fn,"r+");
+	wbfs_file_t *f = wbfs_open_device(fn, mode);
 	if (!f)
 		return NULL;
-	return wbfs_open_hd(wbfs_fread_sector,wbfs_fwrite_sector,wbfs_fclose,f,
-			    sector_size ,n_sector,reset);
+	wbfs_t *p = wbfs_open_hd(wbfs_fread_sector,
+			    mode == WBFS_OPEN_READ_ONLY ? NULL : wbfs_fwrite_sector,
+			    wbfs_fclose,f,sector_size ,n_sector,mode == WBFS_OPEN_RESET);
+	if (!p)
+		wbfs_fclose(f);
+	else if (p->write_hdsector)
+		p->flush_hd = wbfs_fflush;
+	return p;
 }
-wbfs_t *wbfs_try_open_partition(char *fn,int reset)
+wbfs_t *wbfs_try_open_partition(char *fn,int mode)
 {
 	u32 sector_size, n_sector;
 	if(!get_capacity(fn,&sector_size,&n_sector))
 		return NULL;
-	FILE *f = fopen(fn,"r+");
+	wbfs_file_t *f = wbfs_open_device(fn, mode);
 	if (!f)
 		return NULL;
-	return wbfs_open_partition(wbfs_fread_sector,wbfs_fwrite_sector,wbfs_fclose,f,
-				   sector_size ,n_sector,0,reset);
+	wbfs_t *p = wbfs_open_partition(wbfs_fread_sector,
+				   mode == WBFS_OPEN_READ_ONLY ? NULL : wbfs_fwrite_sector,
+				   wbfs_fclose,f,sector_size ,n_sector,0,mode == WBFS_OPEN_RESET);
+	if (!p)
+		wbfs_fclose(f);
+	else if (p->write_hdsector)
+		p->flush_hd = wbfs_fflush;
+	return p;
 }
-wbfs_t *wbfs_try_open(char *disc,char *partition, int reset)
+wbfs_t *wbfs_try_open(char *disc,char *partition, int mode)
 {
 	wbfs_t *p = 0;
+	int reset = mode == WBFS_OPEN_RESET;
 	if(partition)
-		p = wbfs_try_open_partition(partition,reset);
+		p = wbfs_try_open_partition(partition,mode);
 	if (!p && !reset && disc)
-		p = wbfs_try_open_hd(disc,0);
+		p = wbfs_try_open_hd(disc,mode);
 	else if(!p && !reset){
 		char buffer[32];
 		int i;
@@ -208,14 +983,14 @@ wbfs_t *wbfs_try_open(char *disc,char *partition, int reset)
 		for (i='b';i<'z';i++)
 		{
 			snprintf(buffer,32,"/dev/sd%c",i);
-			p = wbfs_try_open_hd(buffer,0);
+			p = wbfs_try_open_hd(buffer,mode);
 			if (p)
 			{
 				fprintf(stderr,"using %s\n",buffer);
 				return p;
 			}
 			snprintf(buffer,32,"/dev/hd%c",i);
-			p = wbfs_try_open_hd(buffer,0);
+			p = wbfs_try_open_hd(buffer,mode);
 			if (p)
 			{
 				fprintf(stderr,"using %s\n",buffer);
@@ -227,7 +1002,7 @@ wbfs_t *wbfs_try_open(char *disc,char *partition, int reset)
 		for (i=0;i<10;i++)
 			for (j=0;j<10;j++){
 				snprintf(buffer,32,"/dev/disk%ds%d",i,j);
-				p = wbfs_try_open_partition(buffer,0);
+				p = wbfs_try_open_partition(buffer,mode);
 				if (p)
 				{
 					fprintf(stderr,"using %s\n",buffer);
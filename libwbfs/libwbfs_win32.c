@@ -10,6 +10,30 @@
 
 #include "libwbfs.h"
 
+// a file opened by wbfs_open_file_for_read/write
+typedef struct wbfs_file_s
+{
+	HANDLE h;
+	int *cancel;	// transfers fail once *cancel is set, see wbfs_file_set_cancel()
+}wbfs_file_t;
+
+static wbfs_file_t *file_new(HANDLE handle)
+{
+	wbfs_file_t *f = wbfs_malloc(sizeof(*f));
+	if (!f)
+	{
+		CloseHandle(handle);
+		return 0;
+	}
+	f->h = handle;
+	f->cancel = 0;
+	return f;
+}
+static int file_cancelled(wbfs_file_t *f)
+{
+	return f->cancel && *f->cancel;
+}
+
 void *wbfs_open_file_for_read(char*filename)
 {
 	HANDLE *handle = CreateFile(filename, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
@@ -19,7 +43,7 @@ void *wbfs_open_file_for_read(char*filename)
 		fprintf(stderr, "unable to open disc file\n");
                 return 0;
         }
-        return (void*)handle;
+        return file_new(handle);
 }
 void *wbfs_open_file_for_write(char*filename)
 {
@@ -29,32 +53,55 @@ void *wbfs_open_file_for_write(char*filename)
 		fprintf(stderr, "unable to open file\n");
                 return 0;
         }
-        return (void*)handle;
+        return file_new(handle);
 }
 int wbfs_read_file(void*handle, int len, void *buf)
 {
+        wbfs_file_t *f = handle;
         DWORD read;
-        ReadFile((HANDLE)handle, buf, len, &read, NULL);
+        ReadFile(f->h, buf, len, &read, NULL);
         return read;
 }
 void wbfs_close_file(void *handle)
 {
-        CloseHandle((HANDLE)handle);
+        wbfs_file_t *f = handle;
+        CloseHandle(f->h);
+        wbfs_free(f);
+}
+void wbfs_file_set_cancel(void *handle, int *cancel)
+{
+        ((wbfs_file_t *)handle)->cancel = cancel;
+}
+void wbfs_set_direct_io(int direct)
+{
+}
+void *wbfs_map_sector(rw_sector_callback_t io, void *data, u32 lba, u32 count)
+{
+	return 0;
+}
+int wbfs_clone_sectors(rw_sector_callback_t src_io, void *src, u32 src_lba, u32 src_count,
+		       rw_sector_callback_t dst_io, void *dst, u32 dst_lba, u32 dst_count)
+{
+	return 1;
 }
 void wbfs_file_reserve_space(void*handle,long long size)
 {
+        wbfs_file_t *f = handle;
         LARGE_INTEGER large;
         large.QuadPart = size;
-        SetFilePointerEx((HANDLE)handle, large, NULL, FILE_BEGIN);
-        SetEndOfFile((HANDLE)handle);
+        SetFilePointerEx(f->h, large, NULL, FILE_BEGIN);
+        SetEndOfFile(f->h);
 }
 int wbfs_read_wii_file(void *_handle, u32 _offset, u32 count, void *buf)
 {
-	HANDLE *handle = (HANDLE *)_handle;
+	wbfs_file_t *f = _handle;
+	HANDLE handle = f->h;
 	LARGE_INTEGER large;
 	DWORD read;
 	u64 offset = _offset;
 	
+	if (file_cancelled(f))
+		return 1;
 	offset <<= 2;
 	large.QuadPart = offset;
 	
@@ -82,11 +129,14 @@ int wbfs_read_wii_file(void *_handle, u32 _offset, u32 count, void *buf)
 
 int wbfs_write_wii_sector_file(void *_handle, u32 lba, u32 count, void *buf)
 {
-	HANDLE *handle = (HANDLE *)_handle;
+	wbfs_file_t *f = _handle;
+	HANDLE handle = f->h;
 	LARGE_INTEGER large;
 	DWORD written;
 	u64 offset = lba;
 	
+	if (file_cancelled(f))
+		return 1;
 	offset *= 0x8000;
 	large.QuadPart = offset;
 	
@@ -113,6 +163,145 @@ int wbfs_write_wii_sector_file(void *_handle, u32 lba, u32 count, void *buf)
 	return 0;
 }
 
+// extracted files are stored under dir, the one being written stays open
+typedef struct wbfs_dir_s
+{
+	char *dir;
+	char *path;	// of the open file, NULL for none
+	HANDLE f;
+}wbfs_dir_t;
+
+void *wbfs_open_dir_for_write(char*dirname)
+{
+	wbfs_dir_t *d;
+	DWORD attr;
+	CreateDirectory(dirname, NULL);
+	attr = GetFileAttributes(dirname);
+	if (attr == INVALID_FILE_ATTRIBUTES || !(attr & FILE_ATTRIBUTE_DIRECTORY))
+		return 0;
+	d = wbfs_malloc(sizeof(*d));
+	if (!d)
+		return 0;
+	d->dir = wbfs_malloc(strlen(dirname) + 1);
+	if (!d->dir)
+	{
+		wbfs_free(d);
+		return 0;
+	}
+	strcpy(d->dir, dirname);
+	d->path = 0;
+	d->f = INVALID_HANDLE_VALUE;
+	return d;
+}
+static int dir_close_file(wbfs_dir_t *d)
+{
+	int ret = 0;
+	if (d->f != INVALID_HANDLE_VALUE && !CloseHandle(d->f))
+		ret = 1;
+	d->f = INVALID_HANDLE_VALUE;
+	wbfs_free(d->path);
+	d->path = 0;
+	return ret;
+}
+// the names come from the disc, none of them may leave dir: '\\' and ':' are
+// path syntax here, and windows drops the trailing dots and spaces of a name,
+// so "..." or ". ." would be ".."
+static int dir_open_file(wbfs_dir_t *d, const char *path)
+{
+	char *full, *c, *name;
+	size_t len = strlen(d->dir) + strlen(path) + 2;
+	full = wbfs_malloc(len);
+	if (!full)
+		return 1;
+	_snprintf(full, len, "%s\\%s", d->dir, path);
+	name = full + strlen(d->dir) + 1;
+	for (c = name; ; c++)
+	{
+		if (*c && *c != '/' && *c != '\\' && *c != ':')
+			continue;
+		if (*c == '\\' || *c == ':' || c == name || c[-1] == '.' || c[-1] == ' ')
+		{
+			wbfs_error("bad file name %s", path);
+			wbfs_free(full);
+			return 1;
+		}
+		if (!*c)
+			break;
+		*c = 0;
+		CreateDirectory(full, NULL);
+		*c = '\\';
+		name = c + 1;
+	}
+	d->f = CreateFile(full, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (d->f == INVALID_HANDLE_VALUE)
+		wbfs_error("unable to create %s", full);
+	wbfs_free(full);
+	if (d->f == INVALID_HANDLE_VALUE)
+		return 1;
+	d->path = wbfs_malloc(strlen(path) + 1);
+	if (!d->path)
+	{
+		dir_close_file(d);
+		return 1;
+	}
+	strcpy(d->path, path);
+	return 0;
+}
+int wbfs_write_dir_file(void *_handle, const char *path, u64 offset, u32 count, void *buf)
+{
+	wbfs_dir_t *d = _handle;
+	LARGE_INTEGER large;
+	DWORD written;
+	while (*path == '/')
+		path++;
+	if (!d->path || strcmp(d->path, path))
+	{
+		if (dir_close_file(d))
+		{
+			wbfs_error("error closing extracted file");
+			return 1;
+		}
+		if (dir_open_file(d, path))
+			return 1;
+	}
+	if (!count)
+		return 0;
+	large.QuadPart = offset;
+	written = 0;
+	if (SetFilePointerEx(d->f, large, NULL, FILE_BEGIN) == FALSE
+	    || WriteFile(d->f, buf, count, &written, NULL) == FALSE || written != count)
+	{
+		wbfs_error("error writing extracted file");
+		return 1;
+	}
+	return 0;
+}
+int wbfs_close_dir(void *handle)
+{
+	wbfs_dir_t *d = handle;
+	int ret = dir_close_file(d);
+	wbfs_free(d->dir);
+	wbfs_free(d);
+	return ret;
+}
+
+// no asynchronous queue here, copies run with the reader thread or serially
+wbfs_aio_t *wbfs_aio_open(int depth)
+{
+	return 0;
+}
+int wbfs_aio_submit(wbfs_aio_t *q, rw_sector_callback_t io, void *data, u32 lba, u32 count, void *buf, void *tag)
+{
+	return 1;
+}
+int wbfs_aio_wait(wbfs_aio_t *q, void **tag)
+{
+	return 1;
+}
+void wbfs_aio_close(wbfs_aio_t *q)
+{
+}
+
 static int read_sector(void *_handle, u32 lba, u32 count, void *buf)
 {
 	HANDLE *handle = (HANDLE *)_handle;
@@ -172,13 +361,39 @@ static void close_handle(void *handle)
 	CloseHandle((HANDLE *)handle);
 }
 
-static int get_capacity(char *fileName, u32 *sector_size, u32 *sector_count)
+static void flush_handle(void *handle)
+{
+	if (!FlushFileBuffers((HANDLE *)handle))
+	{
+		wbfs_error("error flushing disc");
+	}
+}
+
+// read-only users share the drive, a read-write one needs it alone
+static void open_access(int mode, DWORD *access, DWORD *share)
+{
+	if (mode == WBFS_OPEN_READ_ONLY)
+	{
+		*access = GENERIC_READ;
+		*share = FILE_SHARE_READ;
+	}
+	else
+	{
+		*access = GENERIC_READ | GENERIC_WRITE;
+		*share = 0;
+	}
+}
+
+static int get_capacity(char *fileName, int mode, u32 *sector_size, u32 *sector_count)
 {
 	DISK_GEOMETRY dg;
 	PARTITION_INFORMATION pi;
 
-	DWORD bytes;
-	HANDLE *handle = CreateFile(fileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+	DWORD bytes, access, share;
+	HANDLE *handle;
+
+	open_access(mode, &access, &share);
+	handle = CreateFile(fileName, access, share, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
 
 	if (handle == INVALID_HANDLE_VALUE)
 	{
@@ -208,18 +423,20 @@ static int get_capacity(char *fileName, u32 *sector_size, u32 *sector_count)
 	return 1;
 }
 
-wbfs_t *wbfs_try_open_hd(char *driveName, int reset)
+wbfs_t *wbfs_try_open_hd(char *driveName, int mode)
 {
 	wbfs_error("no direct harddrive support");
 	return 0;
 }
 
-wbfs_t *wbfs_try_open_partition(char *partitionLetter, int reset)
+wbfs_t *wbfs_try_open_partition(char *partitionLetter, int mode)
 {
 	HANDLE *handle;
+	wbfs_t *p;
 	char drivePath[8] = "\\\\?\\Z:";
 	
 	u32 sector_size, sector_count;
+	DWORD access, share;
 	
 	if (strlen(partitionLetter) != 1)
 	{
@@ -229,28 +446,36 @@ wbfs_t *wbfs_try_open_partition(char *partitionLetter, int reset)
 
 	drivePath[4] = partitionLetter[0];
 	
-	if (!get_capacity(drivePath, &sector_size, &sector_count))
+	if (!get_capacity(drivePath, mode, &sector_size, &sector_count))
 	{
 		return NULL;
 	}
 	
-	handle = CreateFile(drivePath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+	open_access(mode, &access, &share);
+	handle = CreateFile(drivePath, access, share, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
 	
 	if (handle == INVALID_HANDLE_VALUE)
 	{
 		return NULL;
 	}
 	
-	return wbfs_open_partition(read_sector, write_sector, close_handle, handle, sector_size, sector_count, 0, reset);
+	p = wbfs_open_partition(read_sector, mode == WBFS_OPEN_READ_ONLY ? NULL : write_sector, close_handle, handle,
+				sector_size, sector_count, 0, mode == WBFS_OPEN_RESET);
+	if (p && p->write_hdsector)
+	{
+		p->flush_hd = flush_handle;
+	}
+	return p;
 }
 
-wbfs_t *wbfs_try_open(char *disc, char *partition, int reset)
+wbfs_t *wbfs_try_open(char *disc, char *partition, int mode)
 {
 	wbfs_t *p = 0;
+	int reset = mode == WBFS_OPEN_RESET;
 	
 	if (partition)
 	{
-		p = wbfs_try_open_partition(partition,reset);
+		p = wbfs_try_open_partition(partition,mode);
 	}
 	
 	if (!p && !reset && disc)
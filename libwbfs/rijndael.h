@@ -0,0 +1,39 @@
+#ifndef RIJNDAEL_H
+#define RIJNDAEL_H
+
+#include "libwbfs_os.h" // this file is provided by the project wanting to compile libwbfs
+
+#ifdef __cplusplus
+   extern "C" {
+#endif /* __cplusplus */
+
+// expanded key state. Filled by aes_ctx_set_key(), only read afterwards,
+// so one context can be shared by several threads decrypting at once.
+typedef struct aes_ctx_s
+{
+        int Nk,Nb,Nr;
+        u8 fi[24],ri[24];
+        u32 fkey[120];
+        u32 rkey[120];
+
+        // AES-128 round keys in the layout used by the AES-NI code
+        u8 ni_ekey[11][16];
+        u8 ni_dkey[11][16];
+        int ni;         // whole blocks go through AES-NI, clear it to use the tables
+}aes_ctx;
+
+void aes_ctx_set_key(aes_ctx *ctx, u8 *key);
+// CBC mode. aes_ctx_encrypt() leaves the last ciphertext block in iv.
+void aes_ctx_decrypt(aes_ctx *ctx, u8 *iv, u8 *inbuf, u8 *outbuf, unsigned long long len);
+void aes_ctx_encrypt(aes_ctx *ctx, u8 *iv, u8 *inbuf, u8 *outbuf, unsigned long long len);
+
+// same on a single global key, not reentrant
+void aes_set_key(u8 *key);
+void aes_decrypt(u8 *iv, u8 *inbuf, u8 *outbuf, unsigned long long len);
+void aes_encrypt(u8 *iv, u8 *inbuf, u8 *outbuf, unsigned long long len);
+
+#ifdef __cplusplus
+   }
+#endif /* __cplusplus */
+
+#endif
@@ -5,9 +5,6 @@
 
 #include "wiidisc.h"
 
-void aes_set_key(u8 *key);
-void aes_decrypt(u8 *iv, u8 *inbuf, u8 *outbuf, unsigned long long len);
-
 static void _decrypt_title_key(u8 *tik, u8 *title_key)
 {
 	u8 common_key[16]={
@@ -15,18 +12,25 @@ static void _decrypt_title_key(u8 *tik, u8 *title_key)
                 0x73, 0x81, 0xaa, 0xf7
         };
 	u8 iv[16];
+        aes_ctx ctx;
 
 	wbfs_memset(iv, 0, sizeof iv);
 	wbfs_memcpy(iv, tik + 0x01dc, 8);
-        aes_set_key(common_key);
+        aes_ctx_set_key(&ctx, common_key);
 	//_aes_cbc_dec(common_key, iv, tik + 0x01bf, 16, title_key);
-        aes_decrypt(iv, tik + 0x01bf,title_key,16);
+        aes_ctx_decrypt(&ctx, iv, tik + 0x01bf,title_key,16);
 }
 static u32 _be32(const u8 *p)
 {
 	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
 }
 
+static void usage_mark(wiidisc_t *d, u32 sector, u32 n)
+{
+        for(; n && sector < WD_N_SECTORS; n--, sector++)
+                d->sector_usage_table[sector>>5] |= 1U<<(sector&31);
+}
+
 static void disc_read(wiidisc_t *d,u32 offset, u8 *data, u32 len)
 {
         if(data){
@@ -37,16 +41,11 @@ static void disc_read(wiidisc_t *d,u32 offset, u8 *data, u32 len)
                 if(ret)
                         wbfs_fatal("error reading disc (disc_read)");
         }
-        if(d->sector_usage_table)
+        // every sector the range touches, not just len/0x8000 from the first
+        if(d->sector_usage_table && len)
         {
-                u32 blockno = offset>>13;
-                do
-                {
-                        d->sector_usage_table[blockno]=1;
-                        blockno+=1;
-                        if(len>0x8000)
-                                len-=0x8000;
-                }while(len>0x8000);
+                u64 start = (u64)offset<<2;
+                usage_mark(d, start>>15, ((start+len-1)>>15) - (start>>15) + 1);
         }
 }
 
@@ -55,83 +54,211 @@ static void partition_raw_read(wiidisc_t *d,u32 offset, u8 *data, u32 len)
 	disc_read(d, d->partition_raw_offset + offset, data, len);
 }
 
-static void partition_read_block(wiidisc_t *d,u32 blockno, u8 *block)
+// decrypted partition reader
+
+// the internal reader of a wiidisc_t, for the headers and the FST
+#define READER_BLOCKS 8
+#define READER_AHEAD 4
+
+static void reader_free(wd_reader_t *r)
 {
-        u8*raw = d->tmp_buffer;
-	u8 iv[16];
-	u32 offset;
-        if(d->sector_usage_table)
-                d->sector_usage_table[d->partition_block+blockno]=1;
-        offset = d->partition_data_offset + ((0x8000>>2) * blockno);
-        partition_raw_read(d,offset, raw, 0x8000);
+        wbfs_free(r->tag);
+        wbfs_free(r->prev);
+        wbfs_free(r->next);
+        wbfs_free(r->data);
+        if(r->raw)
+                wbfs_iofree(r->raw);
+        wbfs_free(r);
+}
 
-        // decrypt data
-        memcpy(iv, raw + 0x3d0, 16);
-        aes_set_key(d->disc_key);
-        aes_decrypt(iv, raw + 0x400,block,0x7c00);
+static wd_reader_t *reader_new(wiidisc_t *d, u32 n, u32 ra)
+{
+        wd_reader_t *r = wbfs_malloc(sizeof(wd_reader_t));
+        u32 i;
+        if(!r)
+                return 0;
+        wbfs_memset(r,0,sizeof(wd_reader_t));
+        r->d = d;
+        r->n = n ? n : 1;
+        r->ra = ra ? ra : 1;
+        r->tag = wbfs_malloc(r->n*4);
+        r->prev = wbfs_malloc(r->n*4);
+        r->next = wbfs_malloc(r->n*4);
+        r->data = wbfs_malloc((size_t)r->n*0x7c00);
+        r->raw = wbfs_ioalloc(r->ra*0x8000);
+        if(!r->tag || !r->prev || !r->next || !r->data || !r->raw)
+        {
+                reader_free(r);
+                return 0;
+        }
+        for(i = 0; i < r->n; i++)
+        {
+                r->tag[i] = ~0;
+                r->prev[i] = i - 1;
+                r->next[i] = i + 1;
+        }
+        r->mru = 0;
+        r->lru = r->n - 1;
+        return r;
 }
 
-static void partition_read(wiidisc_t *d,u32 offset, u8 *data, u32 len,int fake)
+// the cached blocks are dropped when the partition changes
+static void reader_set_partition(wd_reader_t *r, u32 raw_offset, u32 data_offset,
+                                 u32 data_size, aes_ctx *aes)
 {
-	u8 *block = d->tmp_buffer2;
-	u32 offset_in_block;
-	u32 len_in_block;
-        if(fake &&  d->sector_usage_table==0)
+        u32 i;
+        r->data_blocks = data_size / (0x8000>>2);
+        r->aes = *aes;
+        if(r->partition_raw_offset == raw_offset && r->partition_data_offset == data_offset)
                 return;
+        r->partition_raw_offset = raw_offset;
+        r->partition_data_offset = data_offset;
+        for(i = 0; i < r->n; i++)
+                r->tag[i] = ~0;
+        r->next_pos = 0;
+}
 
-	while(len) {
-		offset_in_block = offset % (0x7c00>>2);
-		len_in_block = 0x7c00 - (offset_in_block<<2);
-		if (len_in_block > len)
-			len_in_block = len;
-                if(!fake){
-                        partition_read_block(d,offset / (0x7c00>>2), block);
-                        wbfs_memcpy(data, block + (offset_in_block<<2), len_in_block);
-                }else
-                        d->sector_usage_table[d->partition_block+(offset/(0x7c00>>2))]=1;
-		data += len_in_block;
-		offset += len_in_block>>2;
-		len -= len_in_block;
-	}
+static u32 reader_find(wd_reader_t *r, u32 block)
+{
+        u32 i;
+        for(i = 0; i < r->n; i++)
+                if(r->tag[i] == block)
+                        return i;
+        return ~0;
 }
 
+// make slot the most recently used
+static void reader_touch(wd_reader_t *r, u32 slot)
+{
+        if(slot == r->mru)
+                return;
+        if(slot == r->lru)
+                r->lru = r->prev[slot];
+        else
+                r->prev[r->next[slot]] = r->prev[slot];
+        r->next[r->prev[slot]] = r->next[slot];
+        r->prev[slot] = ~0;
+        r->next[slot] = r->mru;
+        r->prev[r->mru] = slot;
+        r->mru = slot;
+}
 
-static u32 do_fst(wiidisc_t *d,u8 *fst, const char *names, u32 i)
+// reads n blocks from block into r->raw
+static int reader_read_raw(wd_reader_t *r, u32 block, u32 n)
 {
-	u32 offset;
-	u32 size;
-	const char *name;
-	u32 j;
+        return r->d->read(r->d->fp, r->partition_raw_offset + r->partition_data_offset
+                          + (0x8000>>2) * block, n*0x8000, r->raw);
+}
+
+static void reader_decrypt(wd_reader_t *r, u32 k, u8 *block)
+{
+        u8 iv[16];
+        u8 *raw = r->raw + k*0x8000;
+        wbfs_memcpy(iv, raw + 0x3d0, 16);
+        aes_ctx_decrypt(&r->aes, iv, raw + 0x400, block, 0x7c00);
+}
 
-	name = names + (_be32(fst + 12*i) & 0x00ffffff);
-	size = _be32(fst + 12*i + 8);
+// reads block into the cache, with the ones after it if seq. returns its slot, ~0 on error
+static u32 reader_fill(wd_reader_t *r, u32 block, int seq)
+{
+        u32 n = 1, k, slot = r->lru;
+        if(seq)
+                while(n < r->ra && block + n < r->data_blocks
+                      && reader_find(r, block + n) == ~0U)
+                        n++;
+        // a short image may end before the partition does
+        if(reader_read_raw(r, block, n) && (n == 1 || reader_read_raw(r, block, n = 1)))
+                return ~0;
+        // the last read ahead go in first, so block ends up most recent
+        for(k = n; k--; )
+        {
+                slot = r->lru;
+                reader_decrypt(r, k, r->data + (size_t)slot*0x7c00);
+                r->tag[slot] = block + k;
+                reader_touch(r, slot);
+        }
+        r->readahead += n - 1;
+        return slot;
+}
 
-	if (i == 0) {
-		for (j = 1; j < size && !d->extracted_buffer; ){
-			j = do_fst(d,fst, names, j);
+int wd_reader_read(wd_reader_t *r, u64 offset, u8 *data, u32 len)
+{
+        int seq = offset == r->next_pos;
+        r->next_pos = offset + len;
+        while(len)
+        {
+                u32 block = offset / 0x7c00;
+                u32 off = offset % 0x7c00;
+                u32 slot = reader_find(r, block);
+                u32 l, n, k;
+                if(slot == ~0U && !off && len >= 0x7c00)
+                {
+                        // whole blocks go to data, not through the cache
+                        n = len / 0x7c00;
+                        if(n > r->ra)
+                                n = r->ra;
+                        for(k = 1; k < n && reader_find(r, block + k) == ~0U; k++)
+                                ;
+                        n = k;
+                        if(reader_read_raw(r, block, n))
+                                return 1;
+                        for(k = 0; k < n; k++)
+                                reader_decrypt(r, k, data + k*0x7c00);
+                        r->misses += n;
+                        l = n*0x7c00;
                 }
-		return size;
-	}
-        //printf("name    %s\n",name);
+                else
+                {
+                        if(slot == ~0U)
+                        {
+                                slot = reader_fill(r, block, seq);
+                                if(slot == ~0U)
+                                        return 1;
+                                r->misses++;
+                        }
+                        else
+                        {
+                                reader_touch(r, slot);
+                                r->hits++;
+                        }
+                        l = 0x7c00 - off;
+                        if(l > len)
+                                l = len;
+                        wbfs_memcpy(data, r->data + (size_t)slot*0x7c00 + off, l);
+                }
+                data += l;
+                offset += l;
+                len -= l;
+        }
+        return 0;
+}
 
-	if (fst[12*i]) {
+wd_reader_t *wd_open_reader(wiidisc_t *d, wd_fst_t *f, u32 n_blocks, u32 readahead)
+{
+        wd_reader_t *r = reader_new(d, n_blocks, readahead);
+        if(r)
+                reader_set_partition(r, f->partition_raw_offset, f->partition_data_offset,
+                                     f->partition_data_size, &f->aes);
+        return r;
+}
 
-		for (j = i + 1; j < size && !d->extracted_buffer; )
-			j = do_fst(d,fst, names, j);
+void wd_close_reader(wd_reader_t *r)
+{
+        reader_free(r);
+}
 
-		return size;
-	} else {
-		offset = _be32(fst + 12*i + 4);
-                if(d->extract_pathname && strcmp(name, d->extract_pathname)==0)
-                {
-                        d->extracted_buffer = wbfs_ioalloc(size);
-                        partition_read(d,offset, d->extracted_buffer, size,0);
-                }else
-                        partition_read(d,offset, 0, size,1);
-		return i + 1;
-	}
+static void partition_read(wiidisc_t *d,u32 offset, u8 *data, u32 len,int fake)
+{
+        u64 pos = (u64)offset<<2;
+        if(fake &&  d->sector_usage_table==0)
+                return;
+        if(d->sector_usage_table && len)
+                usage_mark(d, d->partition_block + pos/0x7c00, (pos+len-1)/0x7c00 - pos/0x7c00 + 1);
+        if(!fake && wd_reader_read(d->reader, pos, data, len))
+                wbfs_fatal("error reading disc (partition_read)");
 }
 
+
 static void do_files(wiidisc_t*d)
 {
 	u8 *b = wbfs_ioalloc(0x480); // XXX: determine actual header size
@@ -142,7 +269,7 @@ static void do_files(wiidisc_t*d)
 	u32 apl_size;
 	u8 *apl_header = wbfs_ioalloc(0x20);
 	u8 *fst;
-	u32 n_files;
+	u32 n_files, i;
 	partition_read(d,0, b, 0x480,0);
 
 	dol_offset = _be32(b + 0x0420);
@@ -163,8 +290,10 @@ static void do_files(wiidisc_t*d)
 	partition_read(d,fst_offset, fst, fst_size,0);
 	n_files = _be32(fst + 8);
 
-	if (n_files > 1)
-		do_fst(d,fst, (char *)fst + 12*n_files, 0);
+        // the entries are in order, directories only hold their range
+	for (i = 1; i < n_files && 12*i < fst_size; i++)
+                if (!fst[12*i])
+                        partition_read(d,_be32(fst + 12*i + 4), 0, _be32(fst + 12*i + 8),1);
         wbfs_iofree(b);
         wbfs_iofree(apl_header);
 	wbfs_iofree(fst);
@@ -192,6 +321,7 @@ static void do_partition(wiidisc_t*d)
 	cert_offset = _be32(b + 0x0c);
 	h3_offset = _be32(b + 0x10);
 	d->partition_data_offset = _be32(b + 0x14);
+	d->partition_data_size = _be32(b + 0x18);
         d->partition_block = (d->partition_raw_offset+d->partition_data_offset)>>13;
 	tmd = wbfs_ioalloc(tmd_size);
 	if (tmd == 0)
@@ -206,6 +336,12 @@ static void do_partition(wiidisc_t*d)
 
 
 	_decrypt_title_key(tik, d->disc_key);
+        {
+                aes_ctx aes;
+                aes_ctx_set_key(&aes, d->disc_key);
+                reader_set_partition(d->reader, d->partition_raw_offset, d->partition_data_offset,
+                                     d->partition_data_size, &aes);
+        }
 
 	partition_raw_read(d,h3_offset, 0, 0x18000);
         wbfs_iofree(b);
@@ -231,11 +367,12 @@ static int test_parition_skip(u32 partition_type,partition_selector_t part_sel)
         }
 } 
 
-static void do_disc(wiidisc_t*d)
+#define MAX_PARTITIONS 32 // XXX: don't know the real maximum
+
+// returns the number of partitions, 0 if it isn't a wii disc
+static u32 read_partition_table(wiidisc_t*d, u32 *partition_offset, u32 *partition_type)
 {
 	u8 *b = wbfs_ioalloc(0x100);
-	u64 partition_offset[32]; // XXX: don't know the real maximum
-	u64 partition_type[32]; // XXX: don't know the real maximum
 	u32 n_partitions;
         u32 magic;
 	u32 i;
@@ -243,21 +380,310 @@ static void do_disc(wiidisc_t*d)
         magic=_be32(b+24);
         if(magic!=0x5D1C9EA3){
                 wbfs_error("not a wii disc");
-                return ;
+                wbfs_iofree(b);
+                return 0;
         }
 	disc_read(d,0x40000>>2, b, 0x100);
 	n_partitions = _be32(b);
+        if(n_partitions > MAX_PARTITIONS)
+                n_partitions = MAX_PARTITIONS;
 	disc_read(d,_be32(b + 4), b, 0x100);
 	for (i = 0; i < n_partitions; i++){
 		partition_offset[i] = _be32(b + 8 * i);
 		partition_type[i] = _be32(b + 8 * i+4);
         }
+        wbfs_iofree(b);
+        return n_partitions;
+}
+
+static void do_disc(wiidisc_t*d)
+{
+	u32 partition_offset[MAX_PARTITIONS];
+	u32 partition_type[MAX_PARTITIONS];
+	u32 n_partitions;
+	u32 i;
+        n_partitions = read_partition_table(d, partition_offset, partition_type);
 	for (i = 0; i < n_partitions; i++) {
                 d->partition_raw_offset = partition_offset[i];
                 if(!test_parition_skip(partition_type[i],d->part_sel))
                         do_partition(d);
 	}
+}
+
+// FST index
+//
+// the FST of a partition is read and decrypted once, then kept as a flat
+// array with the parent of every entry and a hash of its path, so files
+// are found and listed without touching the disc again.
+
+// FNV-1a
+#define FST_HASH_BASIS 2166136261U
+#define FST_HASH(h,c) (((h) ^ (u8)(c)) * 16777619U)
+
+static u32 fst_hash_name(u32 h, u32 in_root, const char *name)
+{
+        if(!in_root)
+                h = FST_HASH(h, '/');
+        while(*name)
+                h = FST_HASH(h, *name++);
+        return h;
+}
+
+// point d at the partition of f for partition_read()
+static void fst_select(wiidisc_t *d, wd_fst_t *f)
+{
+        d->partition_raw_offset = f->partition_raw_offset;
+        d->partition_data_offset = f->partition_data_offset;
+        d->partition_data_size = f->partition_data_size;
+        d->partition_block = (f->partition_raw_offset+f->partition_data_offset)>>13;
+        reader_set_partition(d->reader, f->partition_raw_offset, f->partition_data_offset,
+                             f->partition_data_size, &f->aes);
+}
+
+static void fst_free(wd_fst_t *f)
+{
+        wbfs_free(f->e);
+        wbfs_free(f->names);
+        wbfs_free(f->buckets);
+        wbfs_free(f);
+}
+
+static wd_fst_t *fst_parse(wiidisc_t *d, u32 partition_offset, u32 partition_type)
+{
+        wd_fst_t *f = wbfs_malloc(sizeof(wd_fst_t));
+        u8 *tik = wbfs_ioalloc(0x2a4);
+        u8 *b = wbfs_ioalloc(0x480);
+        u8 *fst = 0;
+        u32 fst_offset, fst_size, names_size, n, i, cur, nb;
+
+        if(!f || !tik || !b)
+                goto error;
+        wbfs_memset(f,0,sizeof(wd_fst_t));
+        f->partition_raw_offset = partition_offset;
+        f->partition_type = partition_type;
+
+        d->partition_raw_offset = partition_offset;
+        partition_raw_read(d,0, tik, 0x2a4);
+        partition_raw_read(d,0x2a4>>2, b, 0x1c);
+        f->partition_data_offset = _be32(b + 0x14);
+        f->partition_data_size = _be32(b + 0x18);
+        _decrypt_title_key(tik, d->disc_key);
+        aes_ctx_set_key(&f->aes, d->disc_key);
+
+        fst_select(d, f);
+        partition_read(d,0, b, 0x480,0);
+        fst_offset = _be32(b + 0x0424);
+        fst_size = _be32(b + 0x0428)<<2;
+        if(fst_size < 12)
+                goto bad;
+        fst = wbfs_ioalloc(fst_size);
+        if(!fst)
+                goto error;
+        partition_read(d,fst_offset, fst, fst_size,0);
+        n = _be32(fst + 8);
+        if(n == 0 || n > fst_size/12)
+                goto bad;
+        names_size = fst_size - 12*n;
+
+        for(nb = 1; nb < n; nb <<= 1)
+                ;
+        f->n = n;
+        f->hash_mask = nb - 1;
+        f->e = wbfs_malloc(n*sizeof(wd_fst_entry_t));
+        f->names = wbfs_malloc(names_size+1);
+        f->buckets = wbfs_malloc(nb*4);
+        if(!f->e || !f->names || !f->buckets)
+                goto error;
+        wbfs_memcpy(f->names, fst + 12*n, names_size);
+        f->names[names_size] = 0;
+        wbfs_memset(f->buckets, 0, nb*4);
+
+        wbfs_memset(&f->e[0], 0, sizeof(wd_fst_entry_t));
+        f->e[0].name = names_size;      // ""
+        f->e[0].size = n;
+        f->e[0].hash = FST_HASH_BASIS;
+        f->e[0].is_dir = 1;
+        cur = 0;
+        for(i = 1; i < n; i++)
+        {
+                wd_fst_entry_t *e = &f->e[i];
+                u8 *fe = fst + 12*i;
+                while(cur && i >= f->e[cur].size)
+                        cur = f->e[cur].parent;
+                e->name = _be32(fe) & 0x00ffffff;
+                if(e->name >= names_size)
+                        goto bad;
+                e->parent = cur;
+                e->is_dir = fe[0] != 0;
+                if(e->is_dir)
+                {
+                        // a directory can't end past its parent or before itself
+                        e->offset = 0;
+                        e->size = _be32(fe + 8);
+                        if(e->size <= i || e->size > f->e[cur].size)
+                                goto bad;
+                        cur = i;
+                }
+                else
+                {
+                        e->offset = _be32(fe + 4);
+                        e->size = _be32(fe + 8);
+                }
+                e->hash = fst_hash_name(f->e[e->parent].hash, e->parent == 0, f->names + e->name);
+                e->hash_next = f->buckets[e->hash & f->hash_mask];
+                f->buckets[e->hash & f->hash_mask] = i;
+        }
+        wbfs_iofree(fst);
         wbfs_iofree(b);
+        wbfs_iofree(tik);
+        return f;
+bad:
+        wbfs_error("bad fst in partition at %08x", partition_offset<<2);
+error:
+        if(fst)
+                wbfs_iofree(fst);
+        if(b)
+                wbfs_iofree(b);
+        if(tik)
+                wbfs_iofree(tik);
+        if(f)
+                fst_free(f);
+        return 0;
+}
+
+static wd_fst_t *get_fst(wiidisc_t *d, u32 partition_offset, u32 partition_type)
+{
+        wd_fst_t *f;
+        for(f = d->fst; f; f = f->next)
+                if(f->partition_raw_offset == partition_offset)
+                        return f;
+        f = fst_parse(d, partition_offset, partition_type);
+        if(f)
+        {
+                f->next = d->fst;
+                d->fst = f;
+        }
+        return f;
+}
+
+wd_fst_t *wd_open_fst(wiidisc_t *d, partition_selector_t selector)
+{
+	u32 partition_offset[MAX_PARTITIONS];
+	u32 partition_type[MAX_PARTITIONS];
+	u32 n_partitions, i;
+        n_partitions = read_partition_table(d, partition_offset, partition_type);
+	for (i = 0; i < n_partitions; i++)
+                if(!test_parition_skip(partition_type[i],selector))
+                        return get_fst(d, partition_offset[i], partition_type[i]);
+        return 0;
+}
+
+// entry i has the path p[0..len), without leading or doubled '/'
+static int fst_match(const wd_fst_t *f, u32 i, const char *p, u32 len)
+{
+        while(i)
+        {
+                const char *name = WD_FST_NAME(f, i);
+                u32 l = strlen(name);
+                if(l > len || memcmp(p + len - l, name, l))
+                        return 0;
+                len -= l;
+                i = f->e[i].parent;
+                if(i)
+                {
+                        if(len == 0 || p[len-1] != '/')
+                                return 0;
+                        len--;
+                }
+        }
+        return len == 0;
+}
+
+int wd_fst_find(const wd_fst_t *f, const char *path)
+{
+        char *p = wbfs_malloc(strlen(path)+1);
+        u32 len = 0, h = FST_HASH_BASIS, i;
+        int ret = -1;
+        if(!p)
+                return -1;
+        // drop leading, trailing and doubled '/', hashing as fst_hash_name does
+        while(*path)
+        {
+                if(*path == '/')
+                {
+                        path++;
+                        continue;
+                }
+                if(len)
+                {
+                        p[len++] = '/';
+                        h = FST_HASH(h, '/');
+                }
+                while(*path && *path != '/')
+                {
+                        h = FST_HASH(h, *path);
+                        p[len++] = *path++;
+                }
+        }
+        if(len == 0)
+                ret = 0;
+        else
+                for(i = f->buckets[h & f->hash_mask]; i; i = f->e[i].hash_next)
+                        if(f->e[i].hash == h && fst_match(f, i, p, len))
+                        {
+                                ret = i;
+                                break;
+                        }
+        wbfs_free(p);
+        return ret;
+}
+
+int wd_fst_find_file(const wd_fst_t *f, const char *pathname)
+{
+        u32 i;
+        if(strchr(pathname, '/'))
+                return wd_fst_find(f, pathname);
+        for(i = 1; i < f->n; i++)
+                if(!f->e[i].is_dir && !strcmp(WD_FST_NAME(f, i), pathname))
+                        return i;
+        return -1;
+}
+
+u32 wd_fst_readdir(const wd_fst_t *f, u32 dir, u32 prev)
+{
+        u32 i;
+        if(dir >= f->n || !f->e[dir].is_dir)
+                return 0;
+        if(prev == 0)
+                i = dir + 1;
+        else if(f->e[prev].is_dir)
+                i = f->e[prev].size;
+        else
+                i = prev + 1;
+        return i < f->e[dir].size ? i : 0;
+}
+
+int wd_fst_path(const wd_fst_t *f, u32 i, char *buf, u32 len)
+{
+        u32 j, l, n = 0;
+        if(i >= f->n || len < 2)
+                return 1;
+        for(j = i; j; j = f->e[j].parent)
+                n += strlen(WD_FST_NAME(f, j)) + 1;
+        if(n == 0)
+                n = 1;
+        if(n >= len)
+                return 1;
+        buf[n] = 0;
+        buf[0] = '/';
+        for(j = i; j; j = f->e[j].parent)
+        {
+                l = strlen(WD_FST_NAME(f, j));
+                n -= l;
+                wbfs_memcpy(buf + n, WD_FST_NAME(f, j), l);
+                buf[--n] = '/';
+        }
+        return 0;
 }
 
 wiidisc_t *wd_open_disc(read_wiidisc_callback_t read,void*fp)
@@ -269,44 +695,108 @@ wiidisc_t *wd_open_disc(read_wiidisc_callback_t read,void*fp)
         d->read = read;
         d->fp = fp;
         d->part_sel = ALL_PARTITIONS;
-        d->tmp_buffer = wbfs_ioalloc(0x8000);
-        d->tmp_buffer2 = wbfs_malloc(0x8000);
+        d->reader = reader_new(d, READER_BLOCKS, READER_AHEAD);
+        if(!d->reader)
+        {
+                wbfs_free(d);
+                return 0;
+        }
 
         return d;
 }
 void wd_close_disc(wiidisc_t *d)
 {
-        wbfs_iofree(d->tmp_buffer);
-        wbfs_free(d->tmp_buffer2);
+        wd_fst_t *f;
+        while((f = d->fst))
+        {
+                d->fst = f->next;
+                fst_free(f);
+        }
+        reader_free(d->reader);
         wbfs_free(d);
 }
 // returns a buffer allocated with wbfs_ioalloc() or NULL if not found of alloc error
-// XXX pathname not implemented. files are extracted by their name. 
-// first file found with that name is returned.
+// a pathname without '/' is a file name, the first file found with that name is returned.
 u8 * wd_extract_file(wiidisc_t *d, partition_selector_t partition_type, char *pathname)
 {
-        u8 *retval = 0;
-        d->extract_pathname = pathname;
-        d->extracted_buffer = 0;
-        d->part_sel = partition_type;
-        do_disc(d);
-        d->extract_pathname = 0;
-        d->part_sel = ALL_PARTITIONS;
-        retval = d->extracted_buffer;
-        d->extracted_buffer = 0;
-        return retval;
+	u32 part_offset[MAX_PARTITIONS];
+	u32 part_type[MAX_PARTITIONS];
+	u32 n_partitions, i;
+        wd_fst_t *f;
+        u8 *retval;
+        int k;
+        n_partitions = read_partition_table(d, part_offset, part_type);
+	for (i = 0; i < n_partitions; i++)
+        {
+                if(test_parition_skip(part_type[i],partition_type))
+                        continue;
+                f = get_fst(d, part_offset[i], part_type[i]);
+                if(!f)
+                        continue;
+                k = wd_fst_find_file(f, pathname);
+                if(k <= 0 || f->e[k].is_dir)
+                        continue;
+                retval = wbfs_ioalloc(f->e[k].size);
+                if(!retval)
+                        return 0;
+                fst_select(d, f);
+                partition_read(d,f->e[k].offset, retval, f->e[k].size,0);
+                return retval;
+        }
+        return 0;
 }
 
-void wd_build_disc_usage(wiidisc_t *d, partition_selector_t selector, u8* usage_table)
+void wd_build_disc_usage(wiidisc_t *d, partition_selector_t selector, u32 *usage)
 {
-        d->sector_usage_table = usage_table;
-        wbfs_memset(usage_table,0,143432*2);
+        d->sector_usage_table = usage;
+        wbfs_memset(usage,0,WD_USAGE_WORDS*4);
         d->part_sel = selector;
         do_disc(d);
         d->part_sel = ALL_PARTITIONS;
         d->sector_usage_table = 0;
 }
 
+// any of the n sectors from first used
+static int usage_any(const u32 *usage, u32 first, u32 n)
+{
+        u32 last = first + n;
+        if(last > WD_N_SECTORS)
+                last = WD_N_SECTORS;
+        while(first < last)
+        {
+                u32 k = 32 - (first&31);
+                u32 w = usage[first>>5] >> (first&31);
+                if(k > last - first)
+                {
+                        k = last - first;
+                        w &= (1U<<k)-1;
+                }
+                if(w)
+                        return 1;
+                first += k;
+        }
+        return 0;
+}
+
+u32 wd_usage_extents(const u32 *usage, u32 shift, u32 n_units, wd_extent_t *ext)
+{
+        u32 u, n = 0;
+        for(u = 0; u < n_units; u++)
+        {
+                if(!usage_any(usage, u<<shift, 1<<shift))
+                        continue;
+                if(n && ext[n-1].start + ext[n-1].n == u)
+                        ext[n-1].n++;
+                else
+                {
+                        ext[n].start = u;
+                        ext[n].n = 1;
+                        n++;
+                }
+        }
+        return n;
+}
+
 void wd_fix_partition_table(wiidisc_t *d, partition_selector_t selector, u8* partition_table)
 {
         u8 *b = partition_table;
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include "libwbfs_os.h" // this file is provided by the project wanting to compile libwbfs and wiidisc
+#include "rijndael.h"
 
 #ifdef __cplusplus
    extern "C" {
@@ -24,11 +25,77 @@ typedef enum{
         ONLY_GAME_PARTITION,
 }partition_selector_t;
 
+// wii sectors (0x8000 bytes) of a double layer disc, and the u32 words
+// of a usage bitset with one bit per sector
+#define WD_N_SECTORS (143432*2)
+#define WD_USAGE_WORDS ((WD_N_SECTORS+31)/32)
+
+// a run of used units
+typedef struct wd_extent_s
+{
+        u32 start;
+        u32 n;
+}wd_extent_t;
+
+// one FST entry. directories hold the entries up to size, their subdirectories included
+typedef struct wd_fst_entry_s
+{
+        u32 name;       // offset in names
+        u32 parent;     // directory holding the entry, 0 is the root
+        u32 offset;     // files: start in the partition data, 32bit words
+        u32 size;       // files: bytes. directories: index after the last entry inside
+        u32 hash;       // of the path from the root, see wd_fst_find()
+        u32 hash_next;  // next entry of the same bucket, 0 ends the chain
+        u32 is_dir;
+}wd_fst_entry_t;
+
+// the FST of a partition, parsed once and kept with its wiidisc_t
+typedef struct wd_fst_s
+{
+        struct wd_fst_s *next;
+
+        u32 partition_raw_offset;       // 32bit words from the start of the disc
+        u32 partition_data_offset;      // 32bit words from partition_raw_offset
+        u32 partition_data_size;        // 32bit words, 0 if unknown
+        u32 partition_type;
+        aes_ctx aes;                    // title key
+
+        u32 n;                          // entries, the root at 0 included
+        wd_fst_entry_t *e;
+        char *names;
+        u32 hash_mask;                  // buckets - 1
+        u32 *buckets;                   // first entry of each, 0 for none
+}wd_fst_t;
+
+#define WD_FST_NAME(f,i) ((f)->names + (f)->e[i].name)
+
+// decrypted data of a partition. the 0x7c00 byte blocks are kept most
+// recently used first, and sequential reads fetch ra blocks at once
+typedef struct wd_reader_s
+{
+        struct wiidisc_s *d;
+        u32 partition_raw_offset;
+        u32 partition_data_offset;
+        u32 data_blocks;        // 0 if unknown, there is no read ahead then
+        aes_ctx aes;
+
+        u32 n;                  // blocks kept
+        u32 ra;
+        u32 *tag;               // block in each slot, ~0 for none
+        u32 *prev, *next;       // slots from mru to lru
+        u32 mru, lru;
+        u8 *data;               // n decrypted blocks
+        u8 *raw;                // ra encrypted blocks
+        u64 next_pos;           // end of the last read
+
+        u32 hits, misses, readahead;
+}wd_reader_t;
+
 typedef struct wiidisc_s
 {
         read_wiidisc_callback_t read;
         void *fp;
-        u8 *sector_usage_table;
+        u32 *sector_usage_table;        // bitset, see WD_USAGE_WORDS
 
         // everything points 32bit words.
         u32 disc_raw_offset;
@@ -37,23 +104,48 @@ typedef struct wiidisc_s
         u32 partition_data_size;
         u32 partition_block;
         
-        u8 *tmp_buffer;
-        u8 *tmp_buffer2;
+        wd_reader_t *reader;    // partition_read() of the current partition
         u8 disc_key[16];
         int dont_decrypt;
 
         partition_selector_t part_sel;
 
-        char *extract_pathname;
-        u8  *extracted_buffer;
+        wd_fst_t *fst;                  // the partitions parsed so far
 }wiidisc_t;
 
 wiidisc_t *wd_open_disc(read_wiidisc_callback_t read,void*fp);
 void wd_close_disc(wiidisc_t *);
 // returns a buffer allocated with wbfs_ioalloc() or NULL if not found of alloc error
+// pathname is looked up from the root of the partition, a name without '/'
+// matches the first file of that name.
 u8 * wd_extract_file(wiidisc_t *d, partition_selector_t partition_type, char *pathname);
 
-void wd_build_disc_usage(wiidisc_t *d, partition_selector_t selector, u8* usage_table);
+// the FST of the first partition the selector picks, NULL if none or on error.
+// freed by wd_close_disc()
+wd_fst_t *wd_open_fst(wiidisc_t *d, partition_selector_t selector);
+// the entry of a path like "/files/a/b.arc" or "files/a", -1 if not found. "/" is 0
+int wd_fst_find(const wd_fst_t *f, const char *path);
+// wd_fst_find() for a path with a '/', else the first file named pathname
+int wd_fst_find_file(const wd_fst_t *f, const char *pathname);
+// the entry after prev in directory dir, the first one if prev is 0. returns 0 at the end
+u32 wd_fst_readdir(const wd_fst_t *f, u32 dir, u32 prev);
+// writes the path of entry i to buf. returns 1 if it doesn't fit
+int wd_fst_path(const wd_fst_t *f, u32 i, char *buf, u32 len);
+
+// a reader of the partition of f keeping n_blocks decrypted blocks, 0 on alloc error.
+// it only uses d for the read callback, so readers of one disc may run in
+// different threads when the callback allows it
+wd_reader_t *wd_open_reader(wiidisc_t *d, wd_fst_t *f, u32 n_blocks, u32 readahead);
+// len bytes at offset bytes into the partition data. returns 1 on read error
+int wd_reader_read(wd_reader_t *r, u64 offset, u8 *data, u32 len);
+void wd_close_reader(wd_reader_t *r);
+
+// sets the bit of every sector the selected partitions use, usage holds WD_USAGE_WORDS
+void wd_build_disc_usage(wiidisc_t *d, partition_selector_t selector, u32 *usage);
+
+// the used units of 1<<shift sectors among the first n_units, as ascending runs.
+// ext needs room for n_units/2+1 runs. returns the number of runs
+u32 wd_usage_extents(const u32 *usage, u32 shift, u32 n_units, wd_extent_t *ext);
 
 // effectively remove not copied partition from the partition table.
 void wd_fix_partition_table(wiidisc_t *d, partition_selector_t selector, u8* partition_table);
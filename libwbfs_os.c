@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "libwbfs_os.h"
 #include "message.h"
@@ -50,3 +51,69 @@ void wbfs_warning(const char *s, ...)
 
   show_message("Warning", "%s", msg);
 }
+
+/*
+ * I/O buffers.  Each one is preceded by a page holding its size, so the
+ * data itself is page aligned.  The same few sizes are allocated for
+ * every disc, so freed buffers are kept in a small pool and handed out
+ * again for an allocation of the same size.
+ */
+
+#define IOBUF_ALIGN     4096
+#define IOPOOL_MAX      16
+#define IOPOOL_MAX_SIZE (64 << 20)
+
+struct iobuf_head {
+  size_t size;
+  struct iobuf_head *next;
+};
+
+static pthread_mutex_t iopool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iobuf_head *iopool;
+static size_t iopool_size;
+static int iopool_count;
+
+void *wbfs_ioalloc(size_t size)
+{
+  struct iobuf_head *h, **prev;
+  void *mem;
+
+  pthread_mutex_lock(&iopool_lock);
+  for (prev = &iopool; (h = *prev) != NULL; prev = &h->next)
+    if (h->size == size) {
+      *prev = h->next;
+      iopool_size -= size;
+      iopool_count--;
+      break;
+    }
+  pthread_mutex_unlock(&iopool_lock);
+
+  if (h == NULL) {
+    if (posix_memalign(&mem, IOBUF_ALIGN, IOBUF_ALIGN + size) != 0)
+      return NULL;
+    h = mem;
+    h->size = size;
+  }
+  return (char *) h + IOBUF_ALIGN;
+}
+
+void wbfs_iofree(void *ptr)
+{
+  struct iobuf_head *h;
+
+  if (ptr == NULL)
+    return;
+  h = (struct iobuf_head *) ((char *) ptr - IOBUF_ALIGN);
+
+  pthread_mutex_lock(&iopool_lock);
+  if (iopool_count < IOPOOL_MAX && iopool_size + h->size <= IOPOOL_MAX_SIZE) {
+    h->next = iopool;
+    iopool = h;
+    iopool_size += h->size;
+    iopool_count++;
+    h = NULL;
+  }
+  pthread_mutex_unlock(&iopool_lock);
+
+  free(h);
+}
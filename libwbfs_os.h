@@ -23,8 +23,9 @@ void wbfs_warning(const char *s, ...);
 
 #define wbfs_malloc(x) malloc(x)
 #define wbfs_free(x) free(x)
-#define wbfs_ioalloc(x) malloc(x)
-#define wbfs_iofree(x) free(x)
+/* page aligned, so they can be used for O_DIRECT; freed ones are reused */
+void *wbfs_ioalloc(size_t size);
+void wbfs_iofree(void *ptr);
 
 #define wbfs_ntohl(x) ntohl(x)
 #define wbfs_ntohs(x) ntohs(x)
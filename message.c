@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include <gtk/gtk.h>
 #include <glade/glade.h>
@@ -20,6 +21,24 @@
 static int capturing_msgs = 0;
 static char captured_msgs[1024];
 static size_t captured_msgs_size;
+static pthread_t main_thread;
+
+/**
+ * Remember the thread running GTK. Messages coming from libwbfs
+ * worker threads can't open dialogs and go to stderr instead.
+ */
+void init_messages(void)
+{
+  main_thread = pthread_self();
+}
+
+static int from_worker_thread(const char *title, const char *msg)
+{
+  if (pthread_equal(pthread_self(), main_thread))
+    return 0;
+  fprintf(stderr, "%s: %s\n", title, msg);
+  return 1;
+}
 
 static GtkResponseType show_dialog_message(const char *title, const char *msg, GtkMessageType type, GtkButtonsType buttons)
 {
@@ -104,6 +123,8 @@ void show_message(const char *title, const char *s, ...)
   vsnprintf(msg, sizeof(msg), s, args);
   va_end(args);
 
+  if (from_worker_thread(title, msg))
+    return;
   if (capturing_msgs)
     capture_message(msg);
   else
@@ -119,6 +140,8 @@ void show_error(const char *title, const char *s, ...)
   vsnprintf(msg, sizeof(msg), s, args);
   va_end(args);
 
+  if (from_worker_thread(title, msg))
+    return;
   if (capturing_msgs)
     capture_message(msg);
   else
@@ -0,0 +1,227 @@
+/* aes_test.c
+ *
+ * Copyright (C) 2009 Ricardo Massaro
+ *
+ * Licensed under the terms of the GNU GPL, version 2
+ * http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+/*
+ * Checks that the AES-NI and the fixed AES-128 CBC code give the same
+ * bytes as the generic table code, on random keys, IVs, lengths and
+ * buffer alignments, out of place and in place.
+ *
+ * "aes_test bench" measures the throughput of each decrypt path on a
+ * 0x7c00 byte payload, the data size of a wii sector.
+ *
+ * rijndael.c is included so the generic decrypt() can be reached.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rijndael.c"
+
+#define N_CASES 4000
+#define MAX_LEN 0x8000
+#define BENCH_LEN 0x7c00
+#define BENCH_SECONDS 0.5
+
+static unsigned int rnd_state = 0x2545f491;
+
+static unsigned int rnd(void)
+{
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 17;
+  rnd_state ^= rnd_state << 5;
+  return rnd_state;
+}
+
+static void rnd_fill(u8 *buf, unsigned int len)
+{
+  while (len--)
+    *buf++ = rnd();
+}
+
+/**
+ * CBC decryption one block at a time through the generic decrypt(),
+ * the way aes_decrypt() worked before the fast paths.  A trailing
+ * partial block is zero padded.
+ */
+static void ref_cbc_decrypt(aes_ctx *ctx, const u8 *iv, const u8 *in, u8 *out, unsigned int len)
+{
+  u8 prev[16], block[16];
+  unsigned int i, n;
+
+  memcpy(prev, iv, 16);
+  while (len > 0) {
+    n = (len < 16) ? len : 16;
+    memset(block, 0, 16);
+    memcpy(block, in, n);
+    decrypt(ctx, (char *) block);
+    for (i = 0; i < n; i++)
+      out[i] = block[i] ^ prev[i];
+    memcpy(prev, in, n);
+    in += n;
+    out += n;
+    len -= n;
+  }
+}
+
+static int check(const char *what, unsigned int test, unsigned int len,
+                 const u8 *got, const u8 *expected)
+{
+  if (memcmp(got, expected, len) == 0)
+    return 0;
+  printf("FAIL: %s, case %u, %u bytes\n", what, test, len);
+  return 1;
+}
+
+static int run_tests(void)
+{
+  static u8 plain[MAX_LEN + 16], cipher[MAX_LEN + 16], expected[MAX_LEN + 16];
+  static u8 work[MAX_LEN + 32], work_ni[MAX_LEN + 32];
+  aes_ctx ctx, ctx_tab;
+  u8 key[16], iv0[16], iv[16], iv_ni[16];
+  unsigned int test, len, align, failed = 0;
+  u8 *buf, *buf_ni;
+
+  for (test = 0; test < N_CASES; test++) {
+    rnd_fill(key, 16);
+    rnd_fill(iv0, 16);
+    len = rnd() % (MAX_LEN + 1);
+    if (test & 1)
+      len &= ~15;           /* whole blocks, as the wii sectors are */
+    align = rnd() % 16;
+    rnd_fill(cipher, len);
+
+    aes_ctx_set_key(&ctx, key);
+    ctx_tab = ctx;
+    ctx_tab.ni = 0;
+    ref_cbc_decrypt(&ctx, iv0, cipher, expected, len);
+
+    /* decrypt out of place */
+    buf = work + align;
+    memcpy(iv, iv0, 16);
+    aes_ctx_decrypt(&ctx_tab, iv, cipher, buf, len);
+    failed += check("table decrypt", test, len, buf, expected);
+    if (ctx.ni) {
+      memcpy(iv, iv0, 16);
+      aes_ctx_decrypt(&ctx, iv, cipher, buf, len);
+      failed += check("AES-NI decrypt", test, len, buf, expected);
+    }
+
+    /* decrypt in place, which only the whole block paths support */
+    if (len % 16 == 0) {
+      memcpy(buf, cipher, len);
+      memcpy(iv, iv0, 16);
+      aes_ctx_decrypt(&ctx_tab, iv, buf, buf, len);
+      failed += check("table decrypt in place", test, len, buf, expected);
+      if (ctx.ni) {
+        memcpy(buf, cipher, len);
+        memcpy(iv, iv0, 16);
+        aes_ctx_decrypt(&ctx, iv, buf, buf, len);
+        failed += check("AES-NI decrypt in place", test, len, buf, expected);
+      }
+    }
+
+    /* encrypt, in place for the odd cases, and round trip */
+    rnd_fill(plain, len);
+    buf = work + align;
+    buf_ni = work_ni + (align ^ 7);
+    memcpy(iv, iv0, 16);
+    if (test & 2) {
+      memcpy(buf, plain, len);
+      aes_ctx_encrypt(&ctx_tab, iv, buf, buf, len);
+    } else
+      aes_ctx_encrypt(&ctx_tab, iv, plain, buf, len);
+    if (ctx.ni) {
+      memcpy(iv_ni, iv0, 16);
+      if (test & 2) {
+        memcpy(buf_ni, plain, len);
+        aes_ctx_encrypt(&ctx, iv_ni, buf_ni, buf_ni, len);
+      } else
+        aes_ctx_encrypt(&ctx, iv_ni, plain, buf_ni, len);
+      failed += check("AES-NI encrypt", test, (len + 15) & ~15, buf_ni, buf);
+      failed += check("AES-NI encrypt iv", test, 16, iv_ni, iv);
+    }
+    if (len % 16 == 0) {
+      memcpy(iv, iv0, 16);
+      aes_ctx_decrypt(&ctx, iv, buf, buf, len);
+      failed += check("round trip", test, len, buf, plain);
+    }
+
+    if (failed > 10)
+      break;
+  }
+
+  aes_ctx_set_key(&ctx, key);
+  printf("aes_test: %u cases, AES-NI %s, %s\n", test,
+         ctx.ni ? "tested" : "not available", failed ? "FAILED" : "ok");
+  return failed != 0;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Decrypt the payload again and again for BENCH_SECONDS with the path
+ * selected by 'mode' and return the throughput in MB/s.
+ */
+static double bench(aes_ctx *ctx, int mode, u8 *buf)
+{
+  u8 iv[16];
+  unsigned long long bytes = 0;
+  double start, elapsed;
+  int i;
+
+  start = now();
+  do {
+    for (i = 0; i < 64; i++) {
+      memset(iv, 0, 16);
+      if (mode == 0)
+        ref_cbc_decrypt(ctx, iv, buf, buf, BENCH_LEN);
+      else
+        aes_ctx_decrypt(ctx, iv, buf, buf, BENCH_LEN);
+      bytes += BENCH_LEN;
+    }
+    elapsed = now() - start;
+  } while (elapsed < BENCH_SECONDS);
+  return bytes / elapsed / 1e6;
+}
+
+static int run_bench(void)
+{
+  static u8 buf[BENCH_LEN];
+  aes_ctx ctx, ctx_tab;
+  u8 key[16];
+
+  rnd_fill(key, 16);
+  rnd_fill(buf, BENCH_LEN);
+  aes_ctx_set_key(&ctx, key);
+  ctx_tab = ctx;
+  ctx_tab.ni = 0;
+
+  printf("CBC decrypt of 0x%x bytes:\n", BENCH_LEN);
+  printf("  generic tables  %8.1f MB/s\n", bench(&ctx_tab, 0, buf));
+  printf("  AES-128 path    %8.1f MB/s\n", bench(&ctx_tab, 1, buf));
+  if (ctx.ni)
+    printf("  AES-NI          %8.1f MB/s\n", bench(&ctx, 1, buf));
+  else
+    printf("  AES-NI          not available\n");
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    return run_bench();
+  return run_tests();
+}
@@ -0,0 +1,430 @@
+/* read_stress.c
+ *
+ * Copyright (C) 2009 Ricardo Massaro
+ *
+ * Licensed under the terms of the GNU GPL, version 2
+ * http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+/*
+ * Stress test for concurrent readers of one wbfs_t.
+ *
+ * A few discs of random data are added to a sparse WBFS image in a
+ * temporary directory and extracted to ISO files.  Then many threads
+ * open the discs and call wbfs_disc_read() on random ranges, each
+ * thread on its own disc handle, and compare the bytes with the
+ * extracted ISOs, while another thread renames and lists the discs.
+ * This runs once with the disc read cache and once without it.
+ *
+ * The discs are not real wii discs: they are added with
+ * wbfs_add_disc_usage() and ALL_PARTITIONS, so nothing is decrypted.
+ * The first one is added with an io_depth above one, and has to be
+ * written by the async queue even though its ISO is a mapped file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "libwbfs.h"
+
+#define N_DISCS 4
+#define N_THREADS 16
+#define N_READS 400
+#define REOPEN_EVERY 50
+#define MAX_READ 0x40000
+#define N_RUNS 24
+#define IMAGE_SIZE (16ULL << 30)
+#define ISO_SECTORS (143432 * 2)
+#define PATH_LEN 512
+#define ADD_IO_DEPTH 4
+
+jmp_buf fatal_jmp_buf;
+
+typedef struct RUN {
+  unsigned long long start, len;  /* bytes */
+} RUN;
+
+typedef struct DISC {
+  char id[7];
+  char iso[PATH_LEN + 16];
+  char out[PATH_LEN + 16];
+  int out_fd;
+  unsigned int n_runs;
+  RUN runs[N_RUNS + 2];           /* used wbfs blocks, merged */
+} DISC;
+
+typedef struct THREAD {
+  pthread_t thread;
+  unsigned int seed;
+  DISC *disc;
+  unsigned int reads;
+  int failed;
+} THREAD;
+
+static char dir[PATH_LEN];
+static char image[PATH_LEN + 16];
+static wbfs_t *part;
+static DISC discs[N_DISCS];
+static int readers_done;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static rw_sector_callback_t hd_write;
+static pthread_t main_thread;
+static unsigned int queued_writes;
+
+void show_error(const char *title, const char *s, ...)
+{
+  va_list args;
+
+  va_start(args, s);
+  fprintf(stderr, "%s: ", title);
+  vfprintf(stderr, s, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+}
+
+void show_message(const char *title, const char *s, ...)
+{
+}
+
+static unsigned int rnd(unsigned int *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+/**
+ * The partition's write callback, counting the writes made away from the
+ * thread adding the disc, that is by the async queue.
+ */
+static int counting_write(void *fp, u32 lba, u32 count, void *buf)
+{
+  if (!pthread_equal(pthread_self(), main_thread)) {
+    pthread_mutex_lock(&done_lock);
+    queued_writes++;
+    pthread_mutex_unlock(&done_lock);
+  }
+  return hd_write(fp, lba, count, buf);
+}
+
+/**
+ * Write a disc of random sectors to disc->iso and add it to the
+ * partition.  The used wbfs blocks are recorded in disc->runs.
+ */
+static int make_disc(DISC *disc, int n, unsigned int *seed)
+{
+  u32 *usage;
+  u8 *sector;
+  void *f;
+  unsigned int i, k, s, len, spb, blk, last;
+  int fd, ret;
+
+  snprintf(disc->id, sizeof(disc->id), "STRS%02d", n);
+  snprintf(disc->iso, sizeof(disc->iso), "%s/STRS%02d.iso", dir, n);
+  snprintf(disc->out, sizeof(disc->out), "%s/STRS%02d.out", dir, n);
+
+  usage = calloc(WD_USAGE_WORDS, 4);
+  sector = malloc(0x8000);
+  fd = open(disc->iso, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (usage == NULL || sector == NULL || fd < 0
+      || ftruncate(fd, (off_t) ISO_SECTORS * 0x8000) != 0) {
+    perror(disc->iso);
+    return 1;
+  }
+
+  /* the header, runs in the first 64MB and one past 4GB */
+  usage[0] |= 1;
+  for (i = 0; i < N_RUNS; i++) {
+    s = (i == N_RUNS - 1) ? 0x20000 + rnd(seed) % 0x1000 : rnd(seed) % 2048;
+    len = 1 + rnd(seed) % 48;
+    for (k = s; k < s + len; k++)
+      usage[k >> 5] |= 1U << (k & 31);
+  }
+  for (s = 0; s < ISO_SECTORS; s++) {
+    if (!(usage[s >> 5] & (1U << (s & 31))))
+      continue;
+    for (k = 0; k < 0x8000; k++)
+      sector[k] = rnd(seed);
+    if (s == 0) {
+      memset(sector, 0, 0x100);
+      memcpy(sector, disc->id, 6);
+      sector[0x18] = 0x5d; sector[0x19] = 0x1c; sector[0x1a] = 0x9e; sector[0x1b] = 0xa3;
+      snprintf((char *) sector + 0x20, 0x40, "Read stress disc %d", n);
+    }
+    if (pwrite(fd, sector, 0x8000, (off_t) s * 0x8000) != 0x8000) {
+      perror(disc->iso);
+      return 1;
+    }
+  }
+  close(fd);
+
+  /* the wbfs blocks holding used sectors, as runs of bytes */
+  spb = part->wbfs_sec_sz >> part->wii_sec_sz_s;
+  disc->n_runs = 0;
+  last = ~0U;
+  for (blk = 0; blk < ISO_SECTORS / spb; blk++) {
+    for (k = 0; k < spb; k++)
+      if (usage[(blk * spb + k) >> 5] & (1U << ((blk * spb + k) & 31)))
+        break;
+    if (k == spb)
+      continue;
+    if (last != ~0U && blk == last + 1)
+      disc->runs[disc->n_runs - 1].len += part->wbfs_sec_sz;
+    else {
+      disc->runs[disc->n_runs].start = (unsigned long long) blk * part->wbfs_sec_sz;
+      disc->runs[disc->n_runs].len = part->wbfs_sec_sz;
+      disc->n_runs++;
+    }
+    last = blk;
+  }
+
+  f = wbfs_open_file_for_read(disc->iso);
+  if (f == NULL)
+    return 1;
+  if (n == 0) {
+    hd_write = part->write_hdsector;
+    part->write_hdsector = counting_write;
+    part->io_depth = ADD_IO_DEPTH;
+  }
+  ret = wbfs_add_disc_usage(part, wbfs_read_wii_file, f, NULL, ALL_PARTITIONS, usage, NULL);
+  if (n == 0) {
+    part->write_hdsector = hd_write;
+    part->io_depth = 1;
+    if (ret == 0 && queued_writes == 0) {
+      fprintf(stderr, "%s wasn't written by the async queue\n", disc->id);
+      ret = 1;
+    }
+  }
+  wbfs_close_file(f);
+  free(usage);
+  free(sector);
+  if (ret != 0)
+    fprintf(stderr, "can't add %s\n", disc->id);
+  return ret;
+}
+
+/**
+ * Extract the disc to disc->out and check it against the source ISO on
+ * the used blocks.
+ */
+static int extract_disc(DISC *disc)
+{
+  wbfs_disc_t *d;
+  void *f;
+  u8 *a, *b;
+  unsigned long long pos, end;
+  int fd, ret;
+
+  d = wbfs_open_disc(part, (u8 *) disc->id);
+  f = wbfs_open_file_for_write(disc->out);
+  if (d == NULL || f == NULL)
+    return 1;
+  wbfs_file_reserve_space(f, (long long) ISO_SECTORS * 0x8000);
+  ret = wbfs_extract_disc(d, wbfs_write_wii_sector_file, f, NULL);
+  wbfs_close_file(f);
+  wbfs_close_disc(d);
+  if (ret != 0)
+    return 1;
+
+  disc->out_fd = open(disc->out, O_RDONLY);
+  fd = open(disc->iso, O_RDONLY);
+  a = malloc(part->wbfs_sec_sz);
+  b = malloc(part->wbfs_sec_sz);
+  if (disc->out_fd < 0 || fd < 0 || a == NULL || b == NULL)
+    return 1;
+  for (ret = 0; ret < (int) disc->n_runs; ret++) {
+    end = disc->runs[ret].start + disc->runs[ret].len;
+    for (pos = disc->runs[ret].start; pos < end; pos += part->wbfs_sec_sz)
+      if (pread(fd, a, part->wbfs_sec_sz, pos) != part->wbfs_sec_sz
+          || pread(disc->out_fd, b, part->wbfs_sec_sz, pos) != part->wbfs_sec_sz
+          || memcmp(a, b, part->wbfs_sec_sz) != 0) {
+        fprintf(stderr, "%s extracted wrong at 0x%llx\n", disc->id, pos);
+        return 1;
+      }
+  }
+  close(fd);
+  free(a);
+  free(b);
+  return 0;
+}
+
+static void *reader(void *arg)
+{
+  THREAD *t = arg;
+  DISC *disc = t->disc;
+  wbfs_disc_t *d = NULL;
+  u8 *got, *expected;
+  RUN *run;
+  unsigned long long off;
+  unsigned int i, len;
+
+  got = malloc(MAX_READ);
+  expected = malloc(MAX_READ);
+  for (i = 0; i < N_READS && !t->failed; i++) {
+    if (i % REOPEN_EVERY == 0) {
+      if (d != NULL)
+        wbfs_close_disc(d);
+      d = wbfs_open_disc(part, (u8 *) disc->id);
+      if (d == NULL) {
+        fprintf(stderr, "%s: can't open disc\n", disc->id);
+        t->failed = 1;
+        break;
+      }
+    }
+    /* a range of one run of used blocks, mostly short and unaligned */
+    run = &disc->runs[rnd(&t->seed) % disc->n_runs];
+    off = run->start + (rnd(&t->seed) % (run->len / 4)) * 4;
+    len = 1 + rnd(&t->seed) % ((i & 3) ? 0x2000 : MAX_READ);
+    if (len > run->start + run->len - off)
+      len = run->start + run->len - off;
+
+    if (pread(disc->out_fd, expected, len, off) != len
+        || wbfs_disc_read(d, off >> 2, got, len) != 0
+        || memcmp(got, expected, len) != 0) {
+      fprintf(stderr, "%s: read of %u bytes at 0x%llx differs\n", disc->id, len, off);
+      t->failed = 1;
+    }
+    t->reads++;
+  }
+  if (d != NULL)
+    wbfs_close_disc(d);
+  free(got);
+  free(expected);
+  return NULL;
+}
+
+static int get_readers_done(void)
+{
+  int done;
+
+  pthread_mutex_lock(&done_lock);
+  done = readers_done;
+  pthread_mutex_unlock(&done_lock);
+  return done;
+}
+
+/**
+ * Rename and list the discs while the readers run.
+ */
+static void *meta_writer(void *arg)
+{
+  wbfs_disc_entry_t list[N_DISCS];
+  char name[0x40];
+  unsigned int i = 0;
+  int *failed = arg;
+
+  while (!get_readers_done() && !*failed) {
+    snprintf(name, sizeof(name), "Renamed %u", i++);
+    if (wbfs_ren_disc(part, (u8 *) discs[i % N_DISCS].id, (u8 *) name) != 0
+        || wbfs_count_discs(part) != N_DISCS
+        || wbfs_list_discs(part, list, N_DISCS) != N_DISCS) {
+      fprintf(stderr, "metadata changed under the readers\n");
+      *failed = 1;
+    }
+  }
+  return NULL;
+}
+
+static void cleanup(void)
+{
+  int i;
+
+  for (i = 0; i < N_DISCS; i++) {
+    if (discs[i].out_fd > 0)
+      close(discs[i].out_fd);
+    unlink(discs[i].iso);
+    unlink(discs[i].out);
+  }
+  unlink(image);
+  rmdir(dir);
+}
+
+/**
+ * Run the readers and the metadata thread once.  Returns 1 on failure
+ * and adds the number of reads done to *reads.
+ */
+static int run_readers(unsigned int seed, unsigned int *reads)
+{
+  THREAD threads[N_THREADS];
+  pthread_t meta;
+  int i, meta_failed = 0, failed = 0;
+
+  readers_done = 0;
+  pthread_create(&meta, NULL, meta_writer, &meta_failed);
+  for (i = 0; i < N_THREADS; i++) {
+    threads[i].seed = seed + (unsigned int) i * 0x632be5ab;
+    threads[i].disc = &discs[i % N_DISCS];
+    threads[i].reads = 0;
+    threads[i].failed = 0;
+    pthread_create(&threads[i].thread, NULL, reader, &threads[i]);
+  }
+  for (i = 0; i < N_THREADS; i++) {
+    pthread_join(threads[i].thread, NULL);
+    *reads += threads[i].reads;
+    failed |= threads[i].failed;
+  }
+  pthread_mutex_lock(&done_lock);
+  readers_done = 1;
+  pthread_mutex_unlock(&done_lock);
+  pthread_join(meta, NULL);
+  return failed | meta_failed;
+}
+
+int main(void)
+{
+  const char *tmp;
+  unsigned int seed = 0x9e3779b9, reads = 0, cache_lines;
+  int i, fd, failed;
+
+  main_thread = pthread_self();
+  tmp = getenv("TMPDIR");
+  snprintf(dir, sizeof(dir), "%s/wbfs_stress.XXXXXX", tmp ? tmp : "/tmp");
+  if (mkdtemp(dir) == NULL) {
+    perror(dir);
+    return 1;
+  }
+  snprintf(image, sizeof(image), "%s/image.wbfs", dir);
+  fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, IMAGE_SIZE) != 0) {
+    perror(image);
+    rmdir(dir);
+    return 1;
+  }
+  close(fd);
+
+  part = wbfs_try_open_partition(image, WBFS_OPEN_RESET);
+  if (part != NULL) {
+    wbfs_close(part);
+    part = wbfs_try_open_partition(image, WBFS_OPEN_RW);
+  }
+  if (part == NULL) {
+    cleanup();
+    return 1;
+  }
+  for (i = 0; i < N_DISCS; i++)
+    if (make_disc(&discs[i], i, &seed) != 0 || extract_disc(&discs[i]) != 0) {
+      wbfs_close(part);
+      cleanup();
+      return 1;
+    }
+
+  /* once with the read cache, once with the direct, unaligned reads */
+  cache_lines = part->disc_cache_lines;
+  failed = run_readers(seed, &reads);
+  part->disc_cache_lines = 0;
+  if (!failed)
+    failed = run_readers(seed ^ 0x5bd1e995, &reads);
+  part->disc_cache_lines = cache_lines;
+
+  wbfs_close(part);
+  cleanup();
+  printf("read_stress: %d threads, %d discs, %u reads, %s\n",
+         N_THREADS, N_DISCS, reads, failed ? "FAILED" : "ok");
+  return failed;
+}
@@ -23,6 +23,7 @@
 #include "message.h"
 #include "progress.h"
 #include "devices.h"
+#include "iso_cache.h"
 
 #include "libwbfs.h"
 
@@ -37,6 +38,7 @@ static DIR_ITEM cur_dir_list[1024];
 static void update_fs_list(void);
 static void update_iso_list(void);
 static int load_device(void);
+static void refresh_device(void);
 
 GtkWidget *get_widget(const char *name)
 {
@@ -212,7 +214,7 @@ static void iso_add_update(int cur, int max)
 static void confirm_add_iso_file(char *filename)
 {
   wbfs_disc_t *disc;
-  FILE *f;
+  ISO_INFO *info;
   char iso_file_path[PATH_MAX];
   char msg[512];
   char code[16], disc_name[64];
@@ -220,22 +222,14 @@ static void confirm_add_iso_file(char *filename)
 
   snprintf(iso_file_path, sizeof(iso_file_path), "%s/%s", cur_directory, filename);
 
-  /* get ISO information */
-  f = fopen(iso_file_path, "r");
-  if (f == NULL) {
-    show_error("Add ISO", "Error: can't open file\n\n%s", iso_file_path);
-    return;
-  }
-  if (fread(code, 1, 6, f) != 6
-      || fseeko(f, 0x20, SEEK_SET) != 0
-      || fread(disc_name, 1, 0x40, f) != 0x40) {
-    fclose(f);
+  /* get ISO information; the analysis is cached for the size and the add */
+  info = iso_cache_get(iso_file_path);
+  if (info == NULL) {
     show_error("Add ISO", "Error: can't read file\n\n%s", iso_file_path);
     return;
   }
-  fclose(f);
-  code[6] = '\0';
-  disc_name[0x39] = '\0';
+  strcpy(code, info->code);
+  strcpy(disc_name, info->title);
 
   /* check if disc is not already there */
   disc = wbfs_open_disc(app_state.wbfs, (u8 *) code);
@@ -260,7 +254,7 @@ static void confirm_add_iso_file(char *filename)
   /* add iso */
   snprintf(msg, sizeof(msg), "Adding ISO file '%s'\n", filename);
   show_progress_dialog("Adding ISO", msg, iso_add_start, iso_file_path, iso_add_update, &cancel_wbfs_op, 0);
-  update_iso_list();
+  refresh_device();
 }
 
 /**
@@ -356,8 +350,8 @@ static void update_iso_list(void)
   GtkTreeIter iter;
   GtkWidget *widget;
   GtkTreeView *iso_list;
-  u8 *buf;
-  u32 size, block_count;
+  wbfs_disc_entry_t *discs;
+  u32 block_count;
   int i, n;
 
   widget = get_widget("iso_list");
@@ -370,25 +364,23 @@ static void update_iso_list(void)
     return;
 
   n = wbfs_count_discs(app_state.wbfs);
-  buf = wbfs_ioalloc(0x100);
-  for (i = 0; i < n; i++)
-    if (wbfs_get_disc_info(app_state.wbfs, i, buf, 0x100, &size) == 0) {
-      char code_txt[16], size_txt[32], name_txt[256];
+  discs = malloc(n * sizeof(*discs) + 1);
+  if (discs == NULL)
+    return;
+  n = wbfs_list_discs(app_state.wbfs, discs, n);
+  for (i = 0; i < n; i++) {
+    char size_txt[32];
 
-      memcpy(code_txt, buf, 6);
-      code_txt[6] = '\0';
-      snprintf(size_txt, sizeof(size_txt), "%.2f GB", (size * 4ULL) / 1024.0 / 1024.0 / 1024.0);
-      memcpy(name_txt, buf + 0x20, 0x40);
-      name_txt[0x39] = '\0';
+    snprintf(size_txt, sizeof(size_txt), "%.2f GB", (discs[i].size * 4ULL) / 1024.0 / 1024.0 / 1024.0);
 
-      gtk_list_store_append(store, &iter);
-      gtk_list_store_set(store, &iter,
-			 0, code_txt,
-			 1, name_txt,
-			 2, size_txt,
-			 -1);
-    }
-  wbfs_iofree(buf);
+    gtk_list_store_append(store, &iter);
+    gtk_list_store_set(store, &iter,
+		       0, discs[i].id,
+		       1, discs[i].title,
+		       2, size_txt,
+		       -1);
+  }
+  free(discs);
 
   /* set space usage information */
   block_count = wbfs_count_usedblocks(app_state.wbfs);
@@ -421,7 +413,7 @@ static int load_device(void)
 
   /* open device */
   start_msg_capture();
-  app_state.wbfs = wbfs_try_open_partition(app_state.dev[app_state.cur_dev], 0);
+  app_state.wbfs = wbfs_try_open_partition(app_state.dev[app_state.cur_dev], WBFS_OPEN_READ_ONLY);
   captured_msgs = end_msg_capture();
   if (app_state.wbfs == NULL) {
     gtk_label_set_markup(GTK_LABEL(widget), "<b>(none)</b>");
@@ -447,6 +439,18 @@ static int load_device(void)
   return 0;
 }
 
+/**
+ * Update the disc list after an operation that wrote to the device,
+ * loading the device again if it couldn't be reopened read-only.
+ */
+static void refresh_device(void)
+{
+  if (app_state.wbfs == NULL)
+    load_device();
+  else
+    update_iso_list();
+}
+
 /**
  * Reload the list of devices
  */
@@ -858,7 +862,7 @@ void iso_remove_clicked_cb(GtkButton *b, gpointer user_data)
   if (get_selected_disc(&code, &name)) {
     if (show_confirmation("Remove Disc", "Remove disc '%s' (%s)?", name, code))
       op_remove_disc(code);
-    update_iso_list();
+    refresh_device();
 
     g_free(code);
     g_free(name);
@@ -872,7 +876,7 @@ void menu_iso_remove_activate_cb(GtkWidget *w, gpointer data)
   if (get_selected_disc(&code, &name)) {
     if (show_confirmation("Remove Disc", "Remove disc '%s' (%s)?", name, code))
       op_remove_disc(code);
-    update_iso_list();
+    refresh_device();
 
     g_free(code);
     g_free(name);
@@ -914,7 +918,7 @@ void menu_iso_rename_activate_cb(GtkWidget *w, gpointer data)
     g_free(code);
     g_free(name);
 
-    update_iso_list();
+    refresh_device();
   }
 }
 
@@ -983,6 +987,7 @@ int main(int argc, char *argv[])
   GtkWidget *main_window;
 
   app_init();
+  init_messages();
   gtk_init(&argc, &argv);
   glade_init();
 
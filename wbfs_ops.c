@@ -13,10 +13,14 @@
 #include "wbfs_ops.h"
 #include "app_state.h"
 #include "message.h"
+#include "iso_cache.h"
 
 #include "libwbfs.h"
 #include "libwbfs_os.h"
 
+/** Copy requests kept in flight; the libwbfs file callbacks are thread safe. */
+#define OP_IO_DEPTH 8
+
 int cancel_wbfs_op;
 
 void dump_wbfs_info(void)
@@ -47,54 +51,44 @@ void dump_wbfs_info(void)
   
 }
 
-static int write_wii_sector_file(void *_fp, u32 lba, u32 count, void *iobuf)
+static void progress_update(int cur, int max)
 {
-  FILE *fp = _fp;
-  u64 off = lba;
-
-  if (cancel_wbfs_op)
-    return 1;
-
-  off *= 0x8000;
-  if (fseeko(fp, off, SEEK_SET)) {
-    show_error("Error writing ISO", "Can't seek in disc file (%llu)", off);
-    return 1;
-  }
-  if (fwrite(iobuf, count*0x8000, 1, fp) != 1) {
-    show_error("Error writing ISO", "Can't write disc file.");
-    return 1;
-  }
-  return 0;
+  printf("DUMMY UPDATE: %u/%u\n", (unsigned int) cur, (unsigned int) max);
 }
 
-static int read_wii_file(void *_fp, u32 offset, u32 count, void *iobuf)
+/**
+ * Reopen the current device in 'mode' if it's open in the other one.
+ * Devices are loaded read-only, so other programs can read them too;
+ * the operations that write switch to read-write and back.
+ * If the device can't be opened again at all, the error is shown and
+ * app_state.wbfs is left NULL; the caller must reload the device.
+ */
+static int reopen_device(int mode)
 {
-  FILE*fp =_fp;
-  u64 off = offset;
-  off<<=2;
+  char *device;
 
-  if (cancel_wbfs_op)
+  if (app_state.wbfs == NULL || app_state.cur_dev < 0)
     return 1;
+  if ((mode == WBFS_OPEN_READ_ONLY) == (app_state.wbfs->write_hdsector == NULL))
+    return 0;
 
-  if (fseeko(fp, off, SEEK_SET)) {
-    show_error("Error reading ISO", "Can't seek in disc file.");
-    return 1;
-  }
-  if (fread(iobuf, count, 1, fp) != 1) {
-    show_error("Error reading ISO", "Can't read disc file.");
-    return 1;
+  device = app_state.dev[app_state.cur_dev];
+  wbfs_close(app_state.wbfs);
+  app_state.wbfs = wbfs_try_open_partition(device, mode);
+  if (app_state.wbfs != NULL)
+    return 0;
+  if (mode != WBFS_OPEN_READ_ONLY) {
+    show_error("Error", "Can't open device '%s' for writing.\n\n(Is it in use by another program?)", device);
+    app_state.wbfs = wbfs_try_open_partition(device, WBFS_OPEN_READ_ONLY);
   }
-  return 0;
-}
-
-static void progress_update(int cur, int max)
-{
-  printf("DUMMY UPDATE: %u/%u\n", (unsigned int) cur, (unsigned int) max);
+  if (app_state.wbfs == NULL)
+    show_error("Error", "Can't reopen device '%s'.\n\n(Is it in use by another program?)", device);
+  return 1;
 }
 
 int op_extract_iso(char *code, char *filename, void (*update)(int, int))
 {
-  FILE *f;
+  void *f;
   wbfs_disc_t *disc;
 
   cancel_wbfs_op = 0;
@@ -109,17 +103,19 @@ int op_extract_iso(char *code, char *filename, void (*update)(int, int))
   }
 
   /* open ISO */
-  f = fopen(filename, "w");
+  f = wbfs_open_file_for_write(filename);
   if (f == NULL) {
     show_error("Error Extracting ISO", "Can't open ISO file '%s'", filename);
     wbfs_close_disc(disc);
     return 1;
   }
+  wbfs_file_set_cancel(f, &cancel_wbfs_op);
 
   wbfs_file_reserve_space(f, (disc->p->n_wii_sec_per_disc/2) * 0x8000ULL);
-  wbfs_extract_disc(disc, write_wii_sector_file, (void *) f, update);
+  disc->p->io_depth = OP_IO_DEPTH;
+  wbfs_extract_disc(disc, wbfs_write_wii_sector_file, f, update);
 
-  fclose(f);
+  wbfs_close_file(f);
   wbfs_close_disc(disc);
   return 0;
 }
@@ -147,27 +143,25 @@ long long info_get_total_space(void)
 
 long long info_get_iso_size(char *filename, void (*update)(int, int))
 {
-  FILE *f;
+  ISO_INFO *info;
   unsigned int used_blocks;
 
-  f = fopen(filename, "r");
-  if (f == NULL)
+  info = iso_cache_get(filename);
+  if (info == NULL)
     return -1LL;
-  used_blocks = wbfs_count_added_disc_blocks(app_state.wbfs,
-					     read_wii_file,
-					     (void *) f,
-					     update,
-					     ONLY_GAME_PARTITION,
-					     0);
-  fclose(f);
+  used_blocks = iso_info_blocks(info, app_state.wbfs);
+  if (update)
+    update(0, used_blocks);
 
   return (unsigned long long) app_state.wbfs->wbfs_sec_sz * used_blocks;
 }
 
 int op_add_iso(char *filename, void (*update)(int, int))
 {
-  FILE *f;
+  void *f;
   wbfs_disc_t *disc;
+  ISO_INFO *info;
+  u32 *usage;
   char code[7];
   int ret;
 
@@ -176,13 +170,14 @@ int op_add_iso(char *filename, void (*update)(int, int))
     update = progress_update;
 
   /* open ISO */
-  f = fopen(filename, "r");
+  f = wbfs_open_file_for_read(filename);
   if (f == NULL) {
     show_error("Error Adding ISO", "Can't open ISO file '%s'", filename);
     return 1;
   }
-  if (fread(code, 1, 6, f) != 6) {
-    fclose(f);
+  wbfs_file_set_cancel(f, &cancel_wbfs_op);
+  if (! wbfs_read_file(f, 6, code)) {
+    wbfs_close_file(f);
     show_error("Error Adding ISO", "Can't read disc ID from file '%s'.", filename);
     return 1;
   }
@@ -192,15 +187,31 @@ int op_add_iso(char *filename, void (*update)(int, int))
   disc = wbfs_open_disc(app_state.wbfs, (u8 *) code);
   if (disc != NULL) {
     wbfs_close_disc(disc);
-    fclose(f);
+    wbfs_close_file(f);
     show_error("Error Adding ISO", "The disc is already in the WBFS partition.");
     return 1;
   }
 
   /* add disc */
-  ret = wbfs_add_disc(app_state.wbfs, read_wii_file, (void *) f, update, ONLY_GAME_PARTITION, 0, NULL);
+  if (reopen_device(WBFS_OPEN_RW)) {
+    wbfs_close_file(f);
+    return 1;
+  }
+  app_state.wbfs->io_depth = OP_IO_DEPTH;
+  /* the usage was most likely built when the size was checked */
+  info = iso_cache_get(filename);
+  usage = (info != NULL) ? malloc(WD_USAGE_WORDS * 4) : NULL;
+  if (usage != NULL) {
+    iso_info_usage(info, usage);
+    ret = wbfs_add_disc_usage(app_state.wbfs, wbfs_read_wii_file, f, update, ONLY_GAME_PARTITION, usage, NULL);
+    free(usage);
+  } else
+    ret = wbfs_add_disc(app_state.wbfs, wbfs_read_wii_file, f, update, ONLY_GAME_PARTITION, 0, NULL);
+  if (ret && ! cancel_wbfs_op)
+    show_error("Error Adding ISO", "Can't add ISO file '%s'.", filename);
   
-  fclose(f);
+  wbfs_close_file(f);
+  reopen_device(WBFS_OPEN_READ_ONLY);
   return ret;
 }
 
@@ -211,7 +222,7 @@ int op_init_partition(char *device)
     app_state.wbfs = NULL;
   }
 
-  app_state.wbfs = wbfs_try_open_partition(device, 1);
+  app_state.wbfs = wbfs_try_open_partition(device, WBFS_OPEN_RESET);
   if (app_state.wbfs != NULL)
     return 0;
   return 1;
@@ -219,18 +230,28 @@ int op_init_partition(char *device)
 
 int op_remove_disc(char *code)
 {
+  int ret = 0;
+
+  if (reopen_device(WBFS_OPEN_RW))
+    return 1;
   if (wbfs_rm_disc(app_state.wbfs, (u8 *) code)) {
     show_error("Error Removing Disc", "Can't find disc id '%s'", code);
-    return 1;
+    ret = 1;
   }
-  return 0;
+  reopen_device(WBFS_OPEN_READ_ONLY);
+  return ret;
 }
 
 int op_rename_disc(char *code, char *new_name)
 {
+  int ret = 0;
+
+  if (reopen_device(WBFS_OPEN_RW))
+    return 1;
   if (wbfs_ren_disc(app_state.wbfs, (u8 *) code, (u8 *) new_name)) {
     show_error("Error Renaming Disc", "Can't find disc id '%s'", code);
-    return 1;
+    ret = 1;
   }
-  return 0;
+  reopen_device(WBFS_OPEN_READ_ONLY);
+  return ret;
 }